@@ -0,0 +1,63 @@
+// Example use of ESP_EEPROM library for ESP8266
+//
+// A normal commit() does all of the flash writing in one go, which can block for tens of ms
+// when the flash sector needs to be erased.
+// Using commitAsync() the work is split into small steps that are done each time poll() is
+// called from loop(), so the rest of the sketch (e.g. fading an LED) keeps running.
+//
+
+#include <ESP_EEPROM.h>
+
+const int BLUE_LED_PIN = 2;
+
+// The neatest way to access variables stored in EEPROM is using a structure
+struct MyEEPROMStruct {
+  int     bootCount;
+  byte    someBytes[200];
+} eepromVar;
+
+unsigned long lastSave = 0;
+int brightness = 0;
+int fadeStep = 4;
+
+void setup() {
+  // Remember to set your serial monitor to 74880 baud
+  // This odd speed will show ESP8266 boot diagnostics too
+  Serial.begin(74880);
+  Serial.println();
+
+  pinMode(BLUE_LED_PIN, OUTPUT);
+
+  EEPROM.begin(sizeof(MyEEPROMStruct));
+  if (EEPROM.percentUsed() >= 0) {
+    EEPROM.get(0, eepromVar);
+  }
+  eepromVar.bootCount++;
+  Serial.print("Boot count: ");
+  Serial.println(eepromVar.bootCount);
+}
+
+void loop() {
+  // keep the LED fading smoothly
+  brightness += fadeStep;
+  if (brightness <= 0 || brightness >= 1020) {
+    fadeStep = -fadeStep;
+  }
+  analogWrite(BLUE_LED_PIN, brightness);
+
+  // save every 10 seconds - this only starts the commit
+  if (millis() - lastSave > 10000) {
+    lastSave = millis();
+    EEPROM.put(0, eepromVar);
+    EEPROM.commitAsync();
+  }
+
+  // do the next small piece of any commit in progress
+  EEPROMStatus st = EEPROM.poll();
+  if (st == EEPROM_FAILED) {
+    Serial.println("Commit failed");
+    EEPROM.commitAsync();   // try again
+  }
+
+  delay(5);
+}
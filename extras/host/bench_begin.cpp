@@ -0,0 +1,60 @@
+// Host benchmark of begin()
+//
+// Times begin() for data sizes from 16 to 2044 bytes with the sector's bitmap empty (one
+// copy), half full and full.  Flash time is from the simulated flash latencies, host time is
+// the library's own work on the PC.
+//
+
+#include "host_test.h"
+
+static const int RUNS = 200;
+
+/**
+ * Commit until no more than a number of commits can be done before the sector is erased.
+ */
+static void fillTo(EEPROMClass &eeprom, int left, uint32_t &value) {
+	do {
+		eeprom.put(0, ++value);
+		eeprom.commit();
+	} while (eeprom.commitsUntilErase() > left);
+}
+
+static void timeBegin(size_t size, int copies, const char* state) {
+	FlashSim& sim = flashSim();
+	uint32_t reads = sim.reads;
+	uint32_t start = micros();
+	uint64_t hostStart = hostNs();
+
+	for (int i = 0; i < RUNS; i++) {
+		EEPROMClass eeprom(0);
+		eeprom.begin(size);
+		eeprom.end();
+	}
+	printf("%5u %7d  %-5s %9lu %9lu %10lu\n", static_cast<unsigned>(size), copies, state,
+			static_cast<unsigned long>((micros() - start) / RUNS),
+			static_cast<unsigned long>((hostNs() - hostStart) / RUNS),
+			static_cast<unsigned long>((sim.reads - reads) / RUNS));
+}
+
+int main() {
+	static const size_t sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2044 };
+
+	printf(" size  copies  state  flash us   host ns  flash reads\n");
+	for (size_t size : sizes) {
+		flashSimBegin(1);
+		EEPROMClass eeprom(0);
+		uint32_t value = 0;
+		eeprom.begin(size);
+		eeprom.put(0, ++value);
+		eeprom.commit();
+		int copies = eeprom.commitsUntilErase() + 1;
+
+		timeBegin(size, copies, "empty");
+		fillTo(eeprom, copies / 2, value);
+		timeBegin(size, copies, "half");
+		fillTo(eeprom, 0, value);
+		timeBegin(size, copies, "full");
+		eeprom.end();
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+// Host benchmark of readBytes(), writeBytes() and fill() against loops of read() and write()
+//
+// Times copying runs of bytes into and out of the buffer, both when every word changes and
+// when the data is already the same, and checks both ways flag the same words as changed.
+//
+
+#include "host_test.h"
+
+static const int RUNS = 2000;
+
+/**
+ * Offsets and lengths of the changed words, to compare the two ways of writing.
+ */
+static uint32_t dirtySignature(EEPROMClass &eeprom) {
+	uint32_t sig = 0;
+	size_t len;
+	for (size_t a = eeprom.dirtyRange(0, len); len; a = eeprom.dirtyRange(a + len, len)) {
+		sig = sig * 31 + a * 7 + len;
+	}
+	return sig;
+}
+
+static void bench(size_t size, size_t offset) {
+	flashSimBegin(1);
+	EEPROMClass eeprom(0);
+	eeprom.begin(2048);
+	eeprom.commit();
+
+	uint8_t in[2048];
+	uint8_t out[2048];
+	size_t length = size - offset;
+	uint64_t ns[6];
+	uint32_t sig[2];
+
+	for (int way = 0; way < 2; way++) {
+		for (int round = 0; round < 2; round++) {
+			// round 0 changes every byte, round 1 writes the same again
+			uint64_t start = hostNs();
+			for (int r = 0; r < RUNS; r++) {
+				if (round == 0) {
+					memset(in, r, length);
+				}
+				if (way == 0) {
+					for (size_t i = 0; i < length; i++) {
+						eeprom.write(offset + i, in[i]);
+					}
+				} else {
+					eeprom.writeBytes(offset, in, length);
+				}
+			}
+			ns[way * 2 + round] = (hostNs() - start) / RUNS;
+		}
+		sig[way] = dirtySignature(eeprom);
+		CHECK(eeprom.commit());
+	}
+	CHECK(sig[0] == sig[1]);
+
+	uint64_t start = hostNs();
+	for (int r = 0; r < RUNS; r++) {
+		for (size_t i = 0; i < length; i++) {
+			out[i] = eeprom.read(offset + i);
+		}
+	}
+	ns[4] = (hostNs() - start) / RUNS;
+	start = hostNs();
+	for (int r = 0; r < RUNS; r++) {
+		CHECK(eeprom.readBytes(offset, out, length) == length);
+	}
+	ns[5] = (hostNs() - start) / RUNS;
+	CHECK(memcmp(in, out, length) == 0);
+
+	start = hostNs();
+	for (int r = 0; r < RUNS; r++) {
+		eeprom.fill(offset, r, length);
+	}
+	uint64_t fillNs = (hostNs() - start) / RUNS;
+	CHECK(eeprom.read(offset) == static_cast<uint8_t>(RUNS - 1));
+	eeprom.end();
+
+	printf("%5u %6u %9lu %9lu %9lu %9lu %9lu %9lu %9lu\n", static_cast<unsigned>(length),
+			static_cast<unsigned>(offset & 3), static_cast<unsigned long>(ns[0]),
+			static_cast<unsigned long>(ns[2]), static_cast<unsigned long>(ns[1]),
+			static_cast<unsigned long>(ns[3]), static_cast<unsigned long>(ns[4]),
+			static_cast<unsigned long>(ns[5]), static_cast<unsigned long>(fillNs));
+}
+
+int main() {
+	static const size_t sizes[] = { 16, 64, 256, 1024, 2044 };
+
+	// loop is a write() or read() for each byte, bulk is one writeBytes() or readBytes()
+	printf("host ns per call      changed data         same data              read\n");
+	printf("bytes offset      loop      bulk      loop      bulk      loop      bulk      fill\n");
+	for (size_t size : sizes) {
+		bench(size, 0);
+		bench(size, 1);
+	}
+	return checkResult("bench_bytes");
+}
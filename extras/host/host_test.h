@@ -0,0 +1,61 @@
+/*
+ host_test.h - helpers for the ESP_EEPROM host test and benchmark programs
+
+ Copyright (c) 2018 James Watson. All rights reserved.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef host_test_h
+#define host_test_h
+
+#include <ESP_EEPROM_host.h>
+#include <ESP_EEPROM.h>
+#include <chrono>
+
+static int checkFailures = 0;
+
+/** Report a failed check and carry on */
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			checkFailures++; \
+		} \
+	} while (0)
+
+/**
+ * Print the result of the checks.
+ *
+ * @param name The name of the program
+ * @return The exit status for main()
+ */
+inline int checkResult(const char* name) {
+	if (checkFailures) {
+		printf("%s: %d checks failed\n", name, checkFailures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+/**
+ * Time taken on the PC, in nanoseconds, since an earlier call.
+ */
+inline uint64_t hostNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Host simulation of how many commits fit in a sector between erases
+//
+// Compares the full copy modes with EEPROM_MODE_DELTA for a 500 byte config with a few
+// typical patterns of change between commits.
+//
+
+#include "host_test.h"
+
+static const size_t SIZE = 500;
+static const int COMMITS = 5000;
+
+struct Pattern {
+	const char* name;
+	uint16_t offsets[4];    ///< where the changes go
+	uint16_t lengths[4];    ///< bytes changed at each offset
+};
+
+static const Pattern patterns[] = {
+	{ "one counter", { 0 }, { 4 } },
+	{ "three fields", { 12, 200, 420 }, { 4, 2, 8 } },
+	{ "32 byte string", { 100 }, { 32 } },
+	{ "half the data", { 0 }, { 250 } },
+};
+
+struct Mode {
+	const char* name;
+	uint32_t mode;
+};
+
+static const Mode modes[] = {
+	{ "copy", EEPROM_MODE_COPY },
+	{ "copy+crc", EEPROM_MODE_COPY | EEPROM_MODE_CRC },
+	{ "sealed", EEPROM_MODE_SEALED },
+	{ "delta", EEPROM_MODE_DELTA },
+};
+
+/**
+ * Commit the pattern of changes over and over and check the data survives a restart.
+ *
+ * @return Commits per sector erase
+ */
+static uint32_t run(const Pattern &pattern, uint32_t mode) {
+	flashSimBegin(1);
+	FlashSim& sim = flashSim();
+	uint8_t expected[SIZE] = { 0 };
+	EEPROMClass eeprom(0);
+
+	eeprom.setMode(mode);
+	eeprom.begin(SIZE);
+	for (int c = 1; c <= COMMITS; c++) {
+		for (int i = 0; i < 4 && pattern.lengths[i]; i++) {
+			for (int b = 0; b < pattern.lengths[i]; b++) {
+				expected[pattern.offsets[i] + b] = c + b;
+			}
+			eeprom.writeBytes(pattern.offsets[i], &expected[pattern.offsets[i]], pattern.lengths[i]);
+		}
+		CHECK(eeprom.commit());
+	}
+	eeprom.end();
+
+	EEPROMClass check(0);
+	uint8_t data[SIZE];
+	check.setMode(mode);
+	check.begin(SIZE);
+	CHECK(check.readBytes(0, data, SIZE) == SIZE && memcmp(data, expected, SIZE) == 0);
+	check.end();
+
+	return sim.erases ? COMMITS / sim.erases : COMMITS;
+}
+
+int main() {
+	printf("%-16s", "commits/erase");
+	for (const Mode &m : modes) {
+		printf("%10s", m.name);
+	}
+	printf("\n");
+
+	for (const Pattern &p : patterns) {
+		printf("%-16s", p.name);
+		for (const Mode &m : modes) {
+			printf("%10lu", static_cast<unsigned long>(run(p, m.mode)));
+		}
+		printf("\n");
+	}
+	return checkResult("sim_delta");
+}
@@ -0,0 +1,97 @@
+// Host test of commitAsync() and poll() interleaved with application work
+//
+// Each poll() must do at most one flash write or erase, of no more than the write chunk, and
+// at every point between polls a restart must find either the old or the new data.
+//
+
+#include "host_test.h"
+
+static const size_t SIZE = 256;
+static const size_t CHUNK = 64;
+static const int COMMITS = 40;
+
+/**
+ * Load the data as it would be after a restart now, then put the flash back as it was so
+ * the commit in progress can carry on.
+ *
+ * @return The value in the first word
+ */
+static uint32_t reboot(uint32_t mode, uint8_t sectors) {
+	FlashSim& sim = flashSim();
+	FlashSim saved = sim;
+	size_t length = sim.sectors * SPI_FLASH_SEC_SIZE;
+	uint8_t* mem = new uint8_t[length];
+	uint32_t value = 0;
+
+	memcpy(mem, sim.mem, length);
+	EEPROMClass reader(0);
+	reader.setMode(mode);
+	reader.setSectors(0, sectors);
+	reader.begin(SIZE);
+	reader.get(0, value);
+	reader.end();
+
+	memcpy(sim.mem, mem, length);
+	sim = saved;
+	delete[] mem;
+	return value;
+}
+
+static void run(const char* name, uint32_t mode, uint8_t sectors) {
+	flashSimBegin(sectors);
+	FlashSim& sim = flashSim();
+	EEPROMClass eeprom(0);
+	uint32_t work = 0;      // stands in for the rest of the application
+	uint32_t longest = 0;
+	int polls = 0;
+
+	eeprom.setMode(mode);
+	eeprom.setSectors(0, sectors);
+	eeprom.setWriteChunk(CHUNK);
+	eeprom.begin(SIZE);
+	CHECK(eeprom.status() == EEPROM_IDLE);
+
+	for (uint32_t value = 1; value <= COMMITS; value++) {
+		uint32_t old = value - 1;
+		eeprom.put(0, value);
+		eeprom.put(4 + (value % 60) * 4, value);
+		// with a single sector the old data goes when it is erased, until the new copy is written
+		bool mayLose = (sectors == 1) && eeprom.willEraseOnNextCommit();
+		CHECK(eeprom.commitAsync());
+
+		while (eeprom.status() == EEPROM_ERASING || eeprom.status() == EEPROM_WRITING) {
+			// application work between polls
+			work += value;
+
+			uint32_t writes = sim.writes;
+			uint32_t erases = sim.erases;
+			uint32_t bytes = sim.bytesWritten;
+			uint32_t start = micros();
+			eeprom.poll();
+			polls++;
+			if (micros() - start > longest) {
+				longest = micros() - start;
+			}
+			CHECK(sim.writes - writes + sim.erases - erases <= 1);
+			CHECK(sim.bytesWritten - bytes <= CHUNK);
+
+			uint32_t seen = reboot(mode, sectors);
+			CHECK(seen == old || seen == value || mayLose);
+		}
+		CHECK(eeprom.status() == EEPROM_DONE);
+		CHECK(reboot(mode, sectors) == value);
+	}
+	eeprom.end();
+	printf("%-10s %2u sector(s): %4d polls for %d commits, longest poll %lu us of flash time\n",
+			name, sectors, polls, COMMITS, static_cast<unsigned long>(longest));
+	CHECK(work > 0);
+}
+
+int main() {
+	run("copy", EEPROM_MODE_COPY, 1);
+	run("copy", EEPROM_MODE_COPY, 2);
+	run("copy+crc", EEPROM_MODE_COPY | EEPROM_MODE_CRC, 2);
+	run("sealed", EEPROM_MODE_SEALED, 2);
+	run("delta", EEPROM_MODE_DELTA, 2);
+	return checkResult("test_async");
+}
@@ -0,0 +1,86 @@
+// Host test of the simulated flash in ESP_EEPROM_host.h
+//
+// Checks it behaves like esp8266 NOR flash and that the library keeps its data in it.
+//
+
+#include "host_test.h"
+
+int main() {
+	flashSimBegin(4);
+	FlashSim& sim = flashSim();
+	uint32_t word;
+
+	// an erase sets every bit, a write can only clear them
+	word = 0x0000ffff;
+	CHECK(spi_flash_write(0, &word, 4) == SPI_FLASH_RESULT_OK);
+	word = 0x00ff00ff;
+	CHECK(spi_flash_write(0, &word, 4) == SPI_FLASH_RESULT_OK);
+	CHECK(spi_flash_read(0, &word, 4) == SPI_FLASH_RESULT_OK);
+	CHECK(word == 0x000000ff);
+	CHECK(spi_flash_erase_sector(0) == SPI_FLASH_RESULT_OK);
+	CHECK(spi_flash_read(0, &word, 4) == SPI_FLASH_RESULT_OK);
+	CHECK(word == 0xffffffff);
+	CHECK(sim.eraseCount[0] == 1 && sim.eraseCount[1] == 0);
+
+	// addresses, lengths and buffers must be aligned and within the flash
+	uint32_t buf[2] = { 0, 0 };
+	CHECK(spi_flash_write(2, buf, 4) == SPI_FLASH_RESULT_ERR);
+	CHECK(spi_flash_write(0, buf, 3) == SPI_FLASH_RESULT_ERR);
+	CHECK(spi_flash_read(0, reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(buf) + 1), 4)
+			== SPI_FLASH_RESULT_ERR);
+	CHECK(spi_flash_read(4 * SPI_FLASH_SEC_SIZE - 4, buf, 8) == SPI_FLASH_RESULT_ERR);
+	CHECK(spi_flash_erase_sector(4) == SPI_FLASH_RESULT_ERR);
+
+	// each operation advances the clock
+	uint32_t start = micros();
+	spi_flash_erase_sector(1);
+	CHECK(micros() - start == sim.eraseLatencyUs);
+
+	// a power cut stops a write part way through and every operation fails until it is back
+	sim.powerBudget = 2;
+	word = 0;
+	CHECK(spi_flash_write(8, &word, 4) == SPI_FLASH_RESULT_ERR);
+	CHECK(sim.mem[8] == 0 && sim.mem[9] == 0 && sim.mem[10] == 0xff);
+	CHECK(spi_flash_write(12, &word, 4) == SPI_FLASH_RESULT_ERR);
+	sim.powerBudget = -1;
+	CHECK(spi_flash_write(12, &word, 4) == SPI_FLASH_RESULT_OK);
+
+	// the library keeps its data in the simulated flash
+	int value = 0;
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(16);
+		eeprom.put(0, 1234);
+		CHECK(eeprom.commit());
+		eeprom.end();
+	}
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(16);
+		CHECK(eeprom.get(0, value) == 1234);
+		eeprom.end();
+	}
+
+	// a file keeps the flash from one run to the next
+	const char* file = "test_flash_sim.bin";
+	unlink(file);
+	CHECK(flashSimBegin(2, file));
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(16);
+		eeprom.put(0, 5678);
+		CHECK(eeprom.commit());
+		eeprom.end();
+	}
+	CHECK(flashSimBegin(2, file));
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(16);
+		CHECK(eeprom.get(0, value) == 5678);
+		eeprom.end();
+	}
+	flashSimEnd();
+	unlink(file);
+
+	return checkResult("test_flash_sim");
+}
@@ -0,0 +1,168 @@
+// Host test of recovery from a power cut during a commit
+//
+// The power is cut after every byte written or erased by a commit (so at every flash
+// operation and every byte boundary within it).  After the restart begin() must load either
+// the old or the new data.  Then the interrupted commit is done again and another one after
+// it, and each must be loaded by the restart after it.
+// With a single sector the data can only be lost while it is being erased, and an in-place
+// write can be left part done.
+//
+
+#include "host_test.h"
+
+struct Scenario {
+	const char* name;
+	uint32_t mode;
+	uint8_t sectors;
+	size_t size;
+	bool erase;             ///< the commit that is cut has to erase a sector
+	bool inPlace;           ///< see EEPROMClass::setInPlace()
+};
+
+static const Scenario scenarios[] = {
+	{ "copy", EEPROM_MODE_COPY, 1, 16, false, false },
+	{ "copy", EEPROM_MODE_COPY, 1, 16, false, true },
+	{ "copy", EEPROM_MODE_COPY, 2, 200, false, false },
+	{ "copy", EEPROM_MODE_COPY, 2, 200, true, false },
+	{ "copy", EEPROM_MODE_COPY, 1, 200, true, false },
+	{ "copy+crc", EEPROM_MODE_COPY | EEPROM_MODE_CRC, 1, 16, false, false },
+	{ "copy+crc", EEPROM_MODE_COPY | EEPROM_MODE_CRC, 2, 200, false, false },
+	{ "copy+crc", EEPROM_MODE_COPY | EEPROM_MODE_CRC, 2, 200, true, false },
+	{ "sealed", EEPROM_MODE_SEALED, 1, 16, false, false },
+	{ "sealed", EEPROM_MODE_SEALED, 1, 16, false, true },
+	{ "sealed", EEPROM_MODE_SEALED, 2, 200, false, false },
+	{ "sealed", EEPROM_MODE_SEALED, 2, 200, true, false },
+	{ "delta", EEPROM_MODE_DELTA, 1, 16, false, false },
+	{ "delta", EEPROM_MODE_DELTA, 2, 200, false, false },
+	{ "delta", EEPROM_MODE_DELTA, 2, 200, true, false },
+};
+
+// each value only clears bits of the one before so in-place writes can be used
+static const uint8_t OLD = 0x77;
+static const uint8_t NEW = 0x33;
+static const uint8_t NEXT = 0x11;
+
+/**
+ * Restart and load the data.
+ *
+ * @param eeprom Set up for the scenario and begun
+ * @return The value of every byte of the data, or -1 if they are not all the same
+ */
+static int load(EEPROMClass &eeprom, const Scenario &s) {
+	uint8_t data[256];
+
+	eeprom.setMode(s.mode);
+	eeprom.setSectors(0, s.sectors);
+	eeprom.setInPlace(s.inPlace);
+	eeprom.begin(s.size);
+	if (eeprom.readBytes(0, data, s.size) != s.size) {
+		return -1;
+	}
+	for (size_t i = 1; i < s.size; i++) {
+		if (data[i] != data[0]) {
+			return -1;
+		}
+	}
+	return data[0];
+}
+
+/**
+ * Commit the same value to every byte of the data.
+ */
+static bool commitAll(EEPROMClass &eeprom, const Scenario &s, uint8_t value) {
+	eeprom.fill(0, value, s.size);
+	return eeprom.commit();
+}
+
+static void run(const Scenario &s) {
+	FlashSim& sim = flashSim();
+	flashSimBegin(s.sectors);
+
+	// the flash as it is just before the commit that is cut
+	{
+		EEPROMClass eeprom(0);
+		load(eeprom, s);
+		commitAll(eeprom, s, 0x11);
+		commitAll(eeprom, s, OLD);
+		while (s.erase && !eeprom.willEraseOnNextCommit()) {
+			commitAll(eeprom, s, 0x11);
+			commitAll(eeprom, s, OLD);
+		}
+		eeprom.end();
+	}
+	size_t length = s.sectors * SPI_FLASH_SEC_SIZE;
+	uint8_t* before = new uint8_t[length];
+	memcpy(before, sim.mem, length);
+
+	// bytes written and erased by the commit with no power cut
+	uint32_t bytes = sim.bytesWritten;
+	uint32_t erases = sim.erases;
+	{
+		EEPROMClass eeprom(0);
+		load(eeprom, s);
+		commitAll(eeprom, s, NEW);
+		eeprom.end();
+	}
+	int32_t total = sim.bytesWritten - bytes + (sim.erases - erases) * SPI_FLASH_SEC_SIZE;
+
+	int oldCount = 0, newCount = 0, lostCount = 0;
+	uint32_t longest = 0;
+	for (int32_t budget = 0; budget < total; budget++) {
+		memcpy(sim.mem, before, length);
+		{
+			EEPROMClass eeprom(0);
+			load(eeprom, s);
+			sim.powerBudget = budget;
+			CHECK(!commitAll(eeprom, s, NEW));
+			eeprom.end();       // before the power is back as it would commit again
+			sim.powerBudget = -1;
+		}
+
+		// restart after the cut
+		EEPROMClass eeprom(0);
+		uint32_t start = micros();
+		int value = load(eeprom, s);
+		if (micros() - start > longest) {
+			longest = micros() - start;
+		}
+		if (value == OLD) {
+			oldCount++;
+		} else if (value == NEW) {
+			newCount++;
+		} else {
+			lostCount++;
+			// an in-place write can be left with some of the changes (see setInPlace())
+			if ((s.sectors > 1 || !s.erase) && !s.inPlace) {
+				printf("%s %u sector(s) size %u: cut after %d bytes loaded %d\n", s.name, s.sectors,
+						static_cast<unsigned>(s.size), budget, value);
+				CHECK(false);
+			}
+		}
+
+		// the commits after it must not be spoilt by what the cut left behind - the same data
+		// again must not be taken as already in the flash
+		static const uint8_t after[] = { NEW, NEXT };
+		for (uint8_t next : after) {
+			CHECK(commitAll(eeprom, s, next));
+			eeprom.end();
+			if (load(eeprom, s) != next) {
+				printf("%s %u sector(s) size %u: cut after %d bytes, commit of %02x lost\n", s.name,
+						s.sectors, static_cast<unsigned>(s.size), budget, next);
+				CHECK(false);
+			}
+		}
+		eeprom.end();
+	}
+	delete[] before;
+
+	printf("%-9s%s %u sector(s) size %3u%s: %5d cuts - old %5d new %5d lost %5d, begin() up to %lu us\n",
+			s.name, s.inPlace ? "+inplace" : "", s.sectors, static_cast<unsigned>(s.size), s.erase ? " erasing" : "        ", total,
+			oldCount, newCount, lostCount, static_cast<unsigned long>(longest));
+}
+
+int main() {
+	for (const Scenario &s : scenarios) {
+		run(s);
+	}
+	return checkResult("test_power_cut");
+}
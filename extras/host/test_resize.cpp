@@ -0,0 +1,86 @@
+// Host test of begin() with a different size from the data in the flash
+//
+// As much of the old data as fits is kept, and after a commit in the new size that is the
+// data the next change of size starts from.
+//
+
+#include "host_test.h"
+
+// the data must be migrated without the heap when the buffer is the caller's
+static int allocations = 0;
+
+void* operator new[](size_t size) {
+	allocations++;
+	return malloc(size);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+static uint32_t buffer[EEPROMClass::bufferSize(200, EEPROM_MODE_DELTA) / 4 + 1];
+
+/**
+ * Restart with a size, commit and check what was loaded.
+ *
+ * The buffer is just big enough for the size.  In read-only mode the data is read first
+ * and then changed, which leaves read-only mode.
+ *
+ * @return The byte at the address (in the data loaded before the commit)
+ */
+static int boot(uint8_t sectors, uint32_t mode, size_t size, size_t address, uint8_t value,
+		bool readOnly = false) {
+	EEPROMClass eeprom(0);
+	eeprom.setSectors(0, sectors);
+	eeprom.setMode(mode);
+	eeprom.setReadOnly(readOnly);
+	int before = allocations;
+	eeprom.begin(size, reinterpret_cast<uint8_t*>(buffer), EEPROMClass::bufferSize(size, mode));
+	CHECK(allocations == before);
+	int loaded = eeprom.read(address);
+	eeprom.write(address, value);
+	CHECK(eeprom.commit());
+	eeprom.end();
+	return loaded;
+}
+
+int main() {
+	static const uint32_t modes[] = { EEPROM_MODE_COPY, EEPROM_MODE_COPY | EEPROM_MODE_CRC,
+			EEPROM_MODE_SEALED, EEPROM_MODE_DELTA };
+	for (uint32_t mode : modes) {
+		for (uint8_t sectors = 1; sectors <= 3; sectors++) {
+			flashSimBegin(sectors);
+
+			// enough commits at the first size to go round the ring
+			EEPROMClass eeprom(0);
+			eeprom.setSectors(0, sectors);
+			eeprom.setMode(mode);
+			eeprom.begin(100);
+			for (int i = 0; i < 50; i++) {
+				eeprom.write(0, i);
+				eeprom.write(50, 7);
+				CHECK(eeprom.commit());
+			}
+			eeprom.end();
+
+			// smaller - the start of the data is kept
+			CHECK(boot(sectors, mode, 60, 50, 8) == 7);
+			// larger - from the size 60 data, not the older size 100 data
+			CHECK(boot(sectors, mode, 200, 50, 9) == 8);
+			CHECK(boot(sectors, mode, 200, 0, 49) == 49);
+			// and back again
+			CHECK(boot(sectors, mode, 100, 50, 10) == 9);
+			CHECK(boot(sectors, mode, 100, 50, 10) == 10);
+
+			// read-only mode loads the old data too, and the first change keeps it
+			CHECK(boot(sectors, mode, 60, 0, 11, true) == 49);
+			CHECK(boot(sectors, mode, 60, 50, 12, true) == 10);
+			CHECK(boot(sectors, mode, 60, 0, 11) == 11);
+		}
+	}
+	return checkResult("test_resize");
+}
@@ -0,0 +1,168 @@
+// Host test of the RTC memory tier over simulated deep sleeps
+//
+// Commits are held in RTC memory and only every few go to the flash.  After a wake the
+// flash is only read when it is needed, and what is found out from it must be right.
+//
+
+#include "host_test.h"
+
+static const uint16_t FLUSH_EVERY = 10;
+
+/**
+ * Wake from deep sleep with the RTC tier.
+ */
+static void wake(EEPROMClass &eeprom) {
+	eeprom.setRtcTier(FLUSH_EVERY);
+	eeprom.begin(32);
+}
+
+int main() {
+	FlashSim& sim = flashSim();
+	flashSimBegin(1);
+	memset(sim.rtc, 0, sizeof(sim.rtc));
+
+	// start from data in the flash so the first wake has nothing to stage
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(32);
+		eeprom.put(0, static_cast<uint32_t>(0));
+		CHECK(eeprom.commit());
+		eeprom.end();
+	}
+
+	// a commit (and the end() after it) on every wake only writes the flash on every
+	// FLUSH_EVERY'th wake
+	uint32_t value = 0;
+	int flashWrites = 0;
+	for (int i = 0; i < 3 * FLUSH_EVERY; i++) {
+		uint32_t writes = sim.writes;
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		eeprom.get(0, value);
+		CHECK(value == static_cast<uint32_t>(i));
+		eeprom.put(0, value + 1);
+		CHECK(eeprom.commit());
+		eeprom.end();
+		bool wrote = sim.writes != writes;
+		CHECK(wrote == ((i + 1) % FLUSH_EVERY == 0));
+		flashWrites += wrote;
+	}
+	CHECK(flashWrites == 3);
+	CHECK(sim.eraseCount[0] == 0);
+
+	// wakes that change nothing do not count towards the flush
+	for (int i = 0; i < 2 * FLUSH_EVERY; i++) {
+		uint32_t writes = sim.writes;
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		CHECK(eeprom.commit());
+		eeprom.end();
+		CHECK(sim.writes == writes);
+	}
+
+	// changes staged on wakes with no commit() at all are counted by end()
+	{
+		uint32_t writes = sim.writes;
+		for (int i = 0; i < FLUSH_EVERY - 1; i++) {
+			EEPROMClass eeprom(0);
+			wake(eeprom);
+			eeprom.put(0, static_cast<uint32_t>(100 + i));
+			eeprom.end();
+		}
+		CHECK(sim.writes == writes);
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		eeprom.put(0, static_cast<uint32_t>(200));
+		eeprom.end();
+		CHECK(sim.writes != writes);
+	}
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(32);       // without the RTC tier
+		CHECK(eeprom.get(0, value) == 200);
+		eeprom.end();
+	}
+
+	// maintain() on every wake must not erase the sector each time
+	uint32_t erases = sim.erases;
+	for (int i = 0; i < 5; i++) {
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		CHECK(eeprom.maintain(90));
+		eeprom.end();
+	}
+	CHECK(sim.erases == erases);
+
+	// the queries describe the flash, not the RTC copy
+	EEPROMStats flashStats;
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(32);       // without the RTC tier
+		eeprom.getStats(flashStats);
+		eeprom.end();
+	}
+	{
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		eeprom.put(0, 1000);    // a change not committed yet
+		int used = eeprom.percentUsed();
+		CHECK(used > 0 && used < 100);
+		CHECK(eeprom.commitsUntilErase() > 0);
+		CHECK(!eeprom.willEraseOnNextCommit());
+		EEPROMStats stats;
+		eeprom.getStats(stats);
+		CHECK(stats.commits == flashStats.commits && stats.commits > 0);
+		CHECK(eeprom.get(0, value) == 1000);
+		CHECK(eeprom.flush());
+		eeprom.end();
+	}
+	{
+		EEPROMClass eeprom(0);
+		eeprom.begin(32);       // without the RTC tier
+		CHECK(eeprom.get(0, value) == 1000);
+		eeprom.end();
+	}
+
+	// after a power cut the RTC copy is lost - the data comes from the flash
+	memset(sim.rtc, 0, sizeof(sim.rtc));
+	{
+		EEPROMClass eeprom(0);
+		wake(eeprom);
+		CHECK(eeprom.get(0, value) == 1000);
+		eeprom.end();
+	}
+
+	// in delta mode the flash is replayed into the shadow without touching the staged data
+	flashSimBegin(1);
+	memset(sim.rtc, 0, sizeof(sim.rtc));
+	for (uint32_t i = 0; i < 4; i++) {
+		StaticEEPROM<32, EEPROM_MODE_DELTA> eeprom(0);
+		eeprom.setRtcTier(FLUSH_EVERY);
+		eeprom.begin();
+		eeprom.put(4 * i, i + 1);
+		CHECK(eeprom.commit());
+		eeprom.end();
+	}
+	{
+		StaticEEPROM<32, EEPROM_MODE_DELTA> eeprom(0);
+		eeprom.setRtcTier(FLUSH_EVERY);
+		eeprom.begin();
+		EEPROMStats stats;
+		eeprom.getStats(stats);
+		CHECK(stats.commits == 0);
+		for (uint32_t i = 0; i < 4; i++) {
+			CHECK(eeprom.get(4 * i, value) == i + 1);
+		}
+		CHECK(eeprom.flush());
+		eeprom.end();
+	}
+	{
+		StaticEEPROM<32, EEPROM_MODE_DELTA> eeprom(0);
+		eeprom.begin();         // without the RTC tier
+		for (uint32_t i = 0; i < 4; i++) {
+			CHECK(eeprom.get(4 * i, value) == i + 1);
+		}
+		eeprom.end();
+	}
+	return checkResult("test_rtc");
+}
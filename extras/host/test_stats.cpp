@@ -0,0 +1,66 @@
+// Host test of percentUsed() and the lifetime statistics kept at the end of the sector
+//
+
+#include "host_test.h"
+
+int main() {
+	// in delta mode the stats are only kept if that leaves room for records
+	for (size_t size = 4064; size <= 4088; size += 4) {
+		flashSimBegin(1);
+		EEPROMClass eeprom(0);
+		eeprom.setMode(EEPROM_MODE_DELTA);
+		eeprom.begin(size);
+		eeprom.put(0, 1);
+		CHECK(eeprom.commit());
+		int used = eeprom.percentUsed();
+		CHECK(used >= 0 && used <= 100);
+		eeprom.put(0, 2);
+		CHECK(eeprom.commit());
+		eeprom.end();
+
+		EEPROMClass check(0);
+		int value = 0;
+		check.setMode(EEPROM_MODE_DELTA);
+		check.begin(size);
+		CHECK(check.get(0, value) == 2);
+		check.end();
+	}
+
+	// a failed commit leaves the sector to be erased by the next one
+	static const uint32_t modes[] = { EEPROM_MODE_COPY, EEPROM_MODE_DELTA };
+	for (uint32_t mode : modes) {
+		flashSimBegin(1);
+		EEPROMClass eeprom(0);
+		eeprom.setMode(mode);
+		eeprom.begin(64);
+		eeprom.put(0, 1);
+		CHECK(eeprom.commit());
+		flashSim().powerBudget = 0;
+		eeprom.put(0, 2);
+		CHECK(!eeprom.commit());
+		flashSim().powerBudget = -1;
+		CHECK(eeprom.percentUsed() == 100);
+		CHECK(eeprom.commitsUntilErase() == 0);
+		CHECK(eeprom.commit());
+		CHECK(eeprom.percentUsed() >= 0 && eeprom.percentUsed() < 100);
+		eeprom.end();
+	}
+
+	// the erases and commits are kept over restarts
+	flashSimBegin(1);
+	for (int boot = 0; boot < 3; boot++) {
+		EEPROMClass eeprom(0);
+		eeprom.begin(256);
+		for (int i = 0; i < 20; i++) {
+			eeprom.put(0, boot * 100 + i);
+			eeprom.commit();
+		}
+		EEPROMStats stats;
+		eeprom.getStats(stats);
+		CHECK(stats.commits == static_cast<uint32_t>(20 * (boot + 1)));
+		CHECK(stats.erases == flashSim().eraseCount[0]);
+		eeprom.end();
+	}
+
+	return checkResult("test_stats");
+}
@@ -66,6 +66,32 @@
  * - Data versions follow consecutively - size rounded up to 4 byte boundaries
  *   and a minimum size
  *
+ * With setMode(EEPROM_MODE_DELTA) the sector holds a log instead:
+ *
+ * - 4 bytes - size of the data with the EEPROM_MODE_DELTA flag set
+ * - Checkpoint - a full copy of the data
+ * - Records - each is a 4 byte header (word offset, word count and a flag marking the last
+ *   record of a commit) followed by the changed words.  Only records up to the last
+ *   complete commit are replayed on top of the checkpoint.
+ *
+ * With setMode(EEPROM_MODE_CRC) each copy is followed by a 4 byte CRC32 of the data.  If the
+ * latest copy fails the check, begin() falls back to the newest earlier copy that passes.
+ *
+ * With setMode(EEPROM_MODE_SEALED) there is no bitmap:
+ *
+ * - 4 bytes - size of the data with the EEPROM_MODE_SEALED flag set
+ * - Slots - each is a copy of the data followed by a 4 byte seal holding the slot number.
+ *   The seal is written last, in the same write as the data, so a copy is only valid once
+ *   its seal is there.  A slot left part written is abandoned by setting its seal to 0.
+ *
+ * The last 16 bytes of the sector hold lifetime statistics, written just after each erase:
+ * a magic word, then the number of erases, commits and bytes written so far.  Copies are
+ * never placed over them.  They are left out if they would take the room of more than 1/8
+ * of the copies (e.g. for data of just under half a sector).
+ *
+ * With setSectors() the data moves round a ring of sectors. The top byte of the size word of
+ * each holds a generation number and the newest sector with complete data is used.
+ *
  * During the begin() call, the library checks if the requested size matches the size of blocks
  * held in the flash.  If so, the bitmap is used to find the most recently written block and this
  * is copied to the buffer held by the library.
@@ -83,6 +109,10 @@
  *
  */
 
+#ifdef ESP_EEPROM_HOST
+#include "ESP_EEPROM_host.h"
+#include "ESP_EEPROM.h"
+#else
 #include "Arduino.h"
 #include "ESP_EEPROM.h"
 #include "flash_hal.h"
@@ -93,9 +123,65 @@ extern "C" {
 #include "os_type.h"
 #include "osapi.h"
 #include "spi_flash.h"
+#include "user_interface.h"
 }
 
 extern "C" uint32_t _FS_end;
+#endif
+
+static_assert(EEPROM_SECTOR_SIZE == SPI_FLASH_SEC_SIZE, "EEPROM_SECTOR_SIZE is wrong");
+
+// EEPROM_MODE_DELTA record header - tag, last record of a commit, word count, word offset
+static const uint32_t DELTA_TAG = 0xd5000000;
+static const uint32_t DELTA_TAG_MASK = 0xff000000;
+static const uint32_t DELTA_LAST = 0x00100000;
+
+// EEPROM_MODE_SEALED seal - tag and slot number
+static const uint32_t SEAL_TAG = 0x5e000000;
+
+// Statistics at the end of the sector - magic, erases, commits, bytes written
+static const uint32_t STATS_MAGIC = 0x57a75e01;
+static const uint16_t STATS_SIZE = 16;
+
+// RTC memory copy - magic, size and mode, commits not in the flash, CRC32 of those and the data
+static const uint32_t RTC_MAGIC = 0x52d7c0de;
+static const uint8_t RTC_USER_BLOCK = 64;   // first 4 byte block of RTC memory for the user
+
+// RTC memory hint - magic, sector, size word, offset of the latest copy, CRC32 of those
+static const uint32_t RTC_HINT_MAGIC = 0x4817a5e0;
+
+// only the first 1MB of the flash can be read through the memory mapped window
+static const uint32_t FLASH_MAPPED_SIZE = 0x100000;
+
+// CRC32 (as used by zip etc) a nibble at a time - a small table at about half the speed of
+// a full byte table
+static const uint32_t CRC_TABLE[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length) {
+	crc = ~crc;
+	while (length--) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ CRC_TABLE[crc & 15];
+		crc = (crc >> 4) ^ CRC_TABLE[crc & 15];
+	}
+	return ~crc;
+}
+
+// Steps of a commit - see poll()
+enum {
+	STEP_ERASE,         // erase the sector
+	STEP_STATS,         // write the statistics at the end of the sector
+	STEP_SIZE,          // write the size word
+	STEP_DATA,          // write the next chunk of a full copy of the data
+	STEP_CRC,           // write the CRC after the copy
+	STEP_PATCH,         // write the next changed words over the latest copy
+	STEP_MARK,          // flag the new copy in the bitmap
+	STEP_RECORD,        // write the next chunk of the words of a delta record
+	STEP_RECORD_HEADER  // write the header of a delta record
+};
 
 //------------------------------------------------------------------------------
 /**
@@ -107,8 +193,20 @@ extern "C" uint32_t _FS_end;
  * @param sector The flash sector to use to hold the EEPROM data
  */
 EEPROMClass::EEPROMClass(uint32_t sector) :
-		_sector(sector), _data(0), _size(0), _bitmapSize(0), _bitmap(0), _offset(
-				0), _dirty(false) {
+		_sector(sector), _firstSector(sector), _sectorCount(1), _prevSector(sector),
+		_generation(0), _nextErased(false), _buffer(0), _bufferLength(0), _ownsBuffer(true),
+		_loaded(false), _data(0), _size(0), _bitmapSize(0), _slotSize(0),
+		_end(SPI_FLASH_SEC_SIZE), _bitmap(0), _offset(0), _offsetDamaged(false), _dirty(false),
+		_mode(EEPROM_MODE_COPY), _inPlace(false), _readOnly(false), _view(0), _migration(0),
+		_rtcFlushEvery(0), _rtcBlock(0), _rtcPending(0), _rtcOnly(false), _rtcHint(false),
+		_rtcHintBlock(0), _shadow(0), _dirtyMap(0), _status(EEPROM_IDLE), _step(0),
+		_commitErase(false), _commitOffset(0), _writeDone(0), _crc(0), _hash(0),
+		_hashValid(false), _rangeStart(0), _rangeCount(0), _deferPending(false), _deferStart(0),
+		_deferMax(0), _deferQuiet(0), _lastChange(0), _chunk(EEPROM_WRITE_CHUNK), _yield(false),
+		_irqOffMax(0), _counters(), _stats() {
+#ifdef ESP_EEPROM_PROFILE
+	resetProfile();
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -137,9 +235,7 @@ EEPROMClass::EEPROMClass(void) :
 #ifndef EEPROM_start
 	#define EEPROM_start _FS_end
 #endif
-		_sector(((EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE)), _data(
-				0), _size(0), _bitmapSize(0), _bitmap(0), _offset(0), _dirty(
-				false) {
+		EEPROMClass((EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE) {
 }
 
 //------------------------------------------------------------------------------
@@ -160,65 +256,146 @@ EEPROMClass::EEPROMClass(void) :
  * Nothing is written to the flash until you call the commit() function, which will erase
  * the sector and write the new data.
  *
+ * If the flash holds data of a different size (in the same mode), e.g. after an update that
+ * added a field to a struct, as much of the old data as fits is kept and the rest is zeroed.
+ * See setMigration().
+ *
+ * Calling begin() again with the same size (and no change of settings) does nothing, keeping
+ * any uncommitted changes - use reload() to read the flash again.
+ *
+ * With the RTC memory tier (see setRtcTier()) the data is loaded from the RTC memory if it
+ * holds a good copy, without reading the flash.  With an RTC memory hint (see setRtcHint())
+ * the latest copy is found without searching the bitmap.
+ *
  * @param size
  */
 void EEPROMClass::begin(size_t size) {
+	if (_loaded && alignedSize(size) == _size) {
+		return;     // already set up - the buffer may have changes not yet committed
+	}
+	_status = EEPROM_IDLE;
 	_dirty = true;
-	if (size <= 0 || size > (SPI_FLASH_SEC_SIZE - 8)) {
-		// max size is smaller by 4 bytes for size and 4 byte bitmap - to keep 4 byte aligned
+	if (size <= 0 || size > (SPI_FLASH_SEC_SIZE - (hasCrc() ? 12 : 8))) {
+		// max size is smaller by 4 bytes for size and 4 byte bitmap (or seal) - to keep 4 byte
+		// aligned (and 4 more for the CRC)
 		return;
-	} else if (size < EEPROM_MIN_SIZE) {
-		size = EEPROM_MIN_SIZE;
 	}
 
-	size = (size + 3) & ~3; // align to 4 bytes
-	_bitmapSize = computeBitmapSize(size);
+	// read-only mode only needs a buffer for the bitmap - delta mode has to replay records
+	bool view = _readOnly && !(_mode & EEPROM_MODE_DELTA)
+			&& (_firstSector + _sectorCount) * SPI_FLASH_SEC_SIZE <= FLASH_MAPPED_SIZE;
+	size_t length = bufferSize(size, _mode);
+	if (view) {
+		length = sealed() ? 0 : computeBitmapSize(slotSize(size, _mode));
+	}
+	if (!_ownsBuffer && length > _bufferLength) {
+		return;     // buffer given to useBuffer() is too small
+	}
+
+	size = alignedSize(size);
+	setLayout(size);
 
-	// drop any old allocation and re-allocate buffers
-	if (_bitmap) {
-		delete[] _bitmap;
+	// re-allocate if the size has changed - all the buffers are carved out of one block
+	if (_ownsBuffer && (!_buffer || length != _bufferLength)) {
+		if (_buffer) {
+			delete[] _buffer;
+		}
+		_buffer = new uint8_t[length];
+		_bufferLength = length;
 	}
-	_bitmap = new uint8_t[_bitmapSize];
-	if (_data) {
-		delete[] _data;
+	memset(_buffer, 0, length);
+	_view = 0;
+	_shadow = 0;
+	if (view) {
+		_data = 0;
+		_bitmap = _buffer;
+		_dirtyMap = 0;
+	} else {
+		_data = _buffer;    // with room for a seal after the data
+		_bitmap = _data + _slotSize;
+		_dirtyMap = reinterpret_cast<uint32_t*>(_bitmap + _bitmapSize);
+		if (_mode & EEPROM_MODE_DELTA) {
+			_shadow = reinterpret_cast<uint8_t*>(_dirtyMap + (size / 4 + 31) / 32);
+		}
 	}
-	_data = new uint8_t[size];
 
-	noInterrupts();
-	spi_flash_read(_sector * SPI_FLASH_SEC_SIZE,
-			reinterpret_cast<uint32_t*>(&_size), 4);
-	interrupts();
+	_nextErased = false;
+	_hashValid = false;
+	_offsetDamaged = false;
 
-	if (_size != size) {
-		// flash structure is all wrong - will need to re-do
-		_size = size;
-		_offset = 0;    // offset of zero => flash data is garbage
+	_rtcOnly = false;
+	if (rtcTier() && _data && readRtc()) {
+		// the latest data is in RTC memory - the flash is only read when it is needed
+		_rtcOnly = true;
+		_loaded = true;
+		return;
+	}
 
-	} else {
-		// Size is correct so get bitmap/data from flash
-		// First read the bitmap from flash
-		noInterrupts();
-		spi_flash_read(_sector * SPI_FLASH_SEC_SIZE + 4,
-				reinterpret_cast<uint32_t*>(_bitmap), _bitmapSize);
-		interrupts();
+	readLatest(_data != 0);
+	if (view && _offset == 0 && findOldSize()) {
+		// data of another size can only be migrated into a buffer
+		_readOnly = false;
+		_loaded = false;
+		begin(size);
+		_readOnly = true;
+		return;
+	}
 
-		// flash should contain a good version of the data - find it using the bitmap
-		_offset = offsetFromBitmap();
+	if (view) {
+		_dirty = false; // nothing can be written until the first write() or put()
+	}
+	readStats();
+	if (_data && !_dirty && _offset != 0 && !(_mode & EEPROM_MODE_DELTA)) {
+		_hash = crc32(0, _data, _size);
+		_hashValid = true;
+	}
+	if (!_dirty) {
+		writeHint();
+	}
+	if (rtcTier() && _data) {
+		// so the next begin() need not read the flash - data the flash does not hold yet
+		// counts as one staged commit
+		_rtcPending = _dirty ? 1 : 0;
+		writeRtc();
+		clearDirty();
+	}
+	_loaded = true;
+}
 
-		if (_offset == 0 || _offset + _size > SPI_FLASH_SEC_SIZE) {
-			// something is screwed up
-			// flag that _data[] is bad / uninitialised
-			_offset = 0;
-		} else {
-			noInterrupts();
-			spi_flash_read(_sector * SPI_FLASH_SEC_SIZE + _offset,
-					reinterpret_cast<uint32_t*>(_data), _size);
-			interrupts();
+//------------------------------------------------------------------------------
+/**
+ * Read the data from the flash again, as begin() does the first time.
+ *
+ * Any changes not yet committed are lost (a commitAsync() in progress is finished first).
+ */
+void EEPROMClass::reload() {
+	if (!_size) {
+		return;
+	}
+	finishCommit();
+	_loaded = false;
+	begin(_size);
+}
 
-			// all good
-			_dirty = false;
-		}
+//------------------------------------------------------------------------------
+/**
+ * Initialise the EEPROM system as begin(size) but keeping the data in a buffer provided by
+ * the caller, e.g. a static buffer, instead of one allocated from the heap.
+ *
+ * The buffer is kept for later calls to begin(size) and is never freed by end() or wipe().
+ *
+ * @param size The size of the EEPROM data
+ * @param buffer The buffer - must be 4 byte aligned
+ * @param length The size of the buffer - at least bufferSize(size, mode)
+ */
+void EEPROMClass::begin(size_t size, uint8_t* buffer, size_t length) {
+	if (!buffer || (reinterpret_cast<uintptr_t>(buffer) & 3)) {
+		return;
+	}
+	if (buffer != _buffer || length != _bufferLength) {
+		useBuffer(buffer, length);
 	}
+	begin(size);
 }
 
 //------------------------------------------------------------------------------
@@ -238,15 +415,111 @@ void EEPROMClass::begin(size_t size) {
  * @return The percentage used (0-100) or -1 if the flash does not hold any copies of the data.
  */
 int EEPROMClass::percentUsed() {
+	if (_rtcOnly) {
+		loadFlash();
+	}
 	if (_offset == 0 || _size == 0)
 		return -1;
-	else {
-		int nCopies = (SPI_FLASH_SEC_SIZE - 4 - _bitmapSize) / _size;
-		int copyNo = 1 + (_offset - 4 - _bitmapSize) / _size;
+	else if (_mode & EEPROM_MODE_DELTA) {
+		// how much of the space after the checkpoint is filled with records
+		int logStart = 4 + _size;
+		if (_offset >= _end || _end <= logStart) {
+			return 100;     // full, or after a failed commit - the next commit will erase
+		}
+		return (100 * (_offset - logStart)) / (_end - logStart);
+	} else {
+		int nCopies = (_end - 4 - _bitmapSize) / _slotSize;
+		int copyNo = 1 + (_offset - 4 - _bitmapSize) / _slotSize;
+		if (copyNo > nCopies) {
+			copyNo = nCopies;   // after a failed commit - the next commit will erase
+		}
 		return (100 * copyNo) / nCopies;
 	}
 }
 
+//------------------------------------------------------------------------------
+/**
+ * Check if the next commit() will need to erase the flash sector.
+ *
+ * In EEPROM_MODE_DELTA this depends on how much of the buffer has changed so far.
+ *
+ * @return True if the next commit will erase the sector before writing.
+ */
+bool EEPROMClass::willEraseOnNextCommit() {
+	return commitsUntilErase() == 0 && !_nextErased;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the number of commits that can be done before the flash sector has to be erased.
+ *
+ * In EEPROM_MODE_DELTA this is an estimate, assuming each commit changes the same amount of
+ * data as has been changed in the buffer so far (or at least one word).
+ *
+ * When several sectors are in use this is the number of commits before the data moves on
+ * to the next sector.
+ *
+ * @return The number of commits that will not need an erase; 0 if the next one will.
+ */
+int EEPROMClass::commitsUntilErase() {
+	if (_rtcOnly) {
+		loadFlash();
+	}
+	if (_offset == 0 || _offset >= _end || _size == 0) {
+		return 0;
+	}
+	if (_mode & EEPROM_MODE_DELTA) {
+		uint32_t needed = 0;
+		uint16_t start, count;
+		uint16_t next = 0;
+		while (_shadow && nextChangedRange(next, start, count)) {
+			needed += 4 + count * 4;
+			next = start + count;
+		}
+		if (needed < 8) {
+			needed = 8;
+		}
+		return (_end - _offset) / needed;
+	}
+	return (_end - _offset - _slotSize) / _slotSize;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Do the flash erase now, at a convenient time, if it would soon be needed anyway.
+ *
+ * Call this when a pause won't matter, e.g. just after boot or before going into deep sleep.
+ * If the sector is more than thresholdPercent full (or the next commit would need to erase
+ * it anyway) the sector is erased and the buffer is written as the only copy, so that later
+ * commits don't need to erase.
+ * Any uncommitted changes in the buffer are written too.
+ *
+ * When several sectors are in use (see setSectors()) this instead erases the sector the
+ * data will move to next, if that has not been done already.
+ *
+ * @see percentUsed()
+ *
+ * @param thresholdPercent How full the sector must be (0-100) to be worth erasing now
+ * @return True if all OK (whether or not an erase was needed); false if there was a problem.
+ */
+bool EEPROMClass::maintain(int thresholdPercent) {
+	if (!_size) {
+		return false;
+	}
+	finishCommit();
+	if (_rtcOnly) {
+		loadFlash();    // the flash has not been read since begin() used the RTC copy
+	}
+	if (_sectorCount > 1) {
+		// moving on to the next sector only needs a write once it has been erased
+		return eraseNextSector();
+	}
+	if (percentUsed() > thresholdPercent || willEraseOnNextCommit()) {
+		return commitReset();
+	}
+	return true;
+}
+
 //------------------------------------------------------------------------------
 /**
  * Free up storage used by the library.
@@ -256,17 +529,28 @@ void EEPROMClass::end() {
 		return;
 
 	commit();
-	if (_data) {
-		delete[] _data;
-	}
-	if (_bitmap) {
-		delete[] _bitmap;
+	release();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Drop the buffers (if the library allocated them) without writing anything.
+ */
+void EEPROMClass::release() {
+	if (_ownsBuffer && _buffer) {
+		delete[] _buffer;
+		_buffer = 0;
+		_bufferLength = 0;
 	}
 	_bitmap = 0;
 	_bitmapSize = 0;
+	_shadow = 0;
+	_dirtyMap = 0;
 	_data = 0;
+	_view = 0;
 	_size = 0;
 	_dirty = false;
+	_loaded = false;
 }
 
 //------------------------------------------------------------------------------
@@ -283,10 +567,14 @@ void EEPROMClass::end() {
  */uint8_t EEPROMClass::read(int const address) {
 	if (address < 0 || (size_t) address >= _size)
 		return 0;
-	if (!_data)
-		return 0;
+	if (_data)
+		return _data[address];
 
-	return _data[address];
+	uint8_t value = 0;
+	if (_view) {
+		readView(address, &value, 1);
+	}
+	return value;
 }
 
 //------------------------------------------------------------------------------
@@ -302,231 +590,2312 @@ void EEPROMClass::end() {
 void EEPROMClass::write(int const address, uint8_t const value) {
 	if (address < 0 || (size_t) address >= _size)
 		return;
+	if (viewing())
+		unview();
 	if (!_data)
 		return;
 
 	// Optimise _dirty. Only flagged if data written is different.
 	if (_data[address] != value) {
 		_data[address] = value;
-		_dirty = true;
+		markDirty(address, 1);
 	}
 }
 
 //------------------------------------------------------------------------------
 /**
- * Perform an erase of the flash sector before committing the data
+ * Read a run of bytes from an offset in the EEPROM data - much quicker than calling
+ * read() for each byte.
  *
- * @return True is all OK; false if there was a problem.
+ * @param address The offset in the data to read from
+ * @param buf Where to put the data
+ * @param length The number of bytes to read
+ * @return The number of bytes read - 0 if the run does not fit in the data
  */
-bool EEPROMClass::commitReset() {
-	// set an offset that ensures flash will be erased before commit
-	uint32_t oldOffset = _offset;   // if commit fails, _offset won't be updated
-	_offset = SPI_FLASH_SEC_SIZE;
-	_dirty = true;                  // ensure writing takes place
-	if (commit()) {
-		return (true);
+size_t EEPROMClass::readBytes(int const address, void* buf, size_t length) {
+	if (!inRange(address, length) || (!_data && !_view))
+		return 0;
+
+	if (_data) {
+		memcpy(buf, _data + address, length);
 	} else {
-		_offset = oldOffset;
-		return (false);
+		readView(address, buf, length);
 	}
+	return length;
 }
 
 //------------------------------------------------------------------------------
 /**
- * Write the EEPROM data to the flash memory.
+ * Write a run of bytes, e.g. a string or an array, to an offset in the EEPROM data buffer.
  *
- * The flash segment for EEPROM data is erased if necessary before performing the write.
- * The library maintains a record of whether the buffer has been changed and the write
- * to flash is only performed if the flash does not yet have a copy of the data or
- * if the data in the buffer has changed from what is stored in the flash memory.
+ * As with put() only the 4 byte words that actually change are flagged for the next commit().
  *
- * @return True if successful (or if no write was needed); false if the write was unsuccessful.
+ * @param address The offset in the data to write to
+ * @param buf The data to write
+ * @param length The number of bytes to write
+ * @return False if the run does not fit in the data - nothing is written
  */
-bool EEPROMClass::commit() {
-	// everything has to be in place to even try a commit
-	if (!_size || !_data || !_bitmap || _bitmapSize == 0) {
-		return false;
-	}
-	if (!_dirty) {
-		return true;
-	}
+bool EEPROMClass::writeBytes(int const address, const void* buf, size_t length) {
+	return update(address, static_cast<const uint8_t*>(buf), 0, length);
+}
 
-	SpiFlashOpResult flashOk = SPI_FLASH_RESULT_OK;
-	uint32_t oldOffset = _offset;   // if write fails, _offset won't be updated
+//------------------------------------------------------------------------------
+/**
+ * Set a run of bytes of the EEPROM data buffer to the same value.
+ *
+ * @param address The offset in the data to start at
+ * @param val The value to set each byte to
+ * @param length The number of bytes to set
+ * @return False if the run does not fit in the data - nothing is written
+ */
+bool EEPROMClass::fill(int const address, uint8_t const val, size_t length) {
+	return update(address, 0, val, length);
+}
 
-	// If initial version or not enough room for new version, erase and start anew
-	if (_offset == 0 || _offset + _size + _size > SPI_FLASH_SEC_SIZE) {
+//------------------------------------------------------------------------------
+/**
+ * Copy a run of bytes into the buffer a word at a time, flagging only the words that change.
+ *
+ * @param address The offset in the data to write to
+ * @param src The data to copy, or null to set every byte to val
+ * @param val The value for every byte when src is null
+ * @param length The number of bytes
+ * @return False if the run does not fit in the data
+ */
+bool EEPROMClass::update(int const address, const uint8_t* src, uint8_t const val, size_t length) {
+	if (!inRange(address, length))
+		return false;
+	if (viewing())
+		unview();
+	if (!_data)
+		return false;
 
-		noInterrupts();
-		flashOk = spi_flash_erase_sector(_sector);
-		interrupts();
-		if (flashOk != SPI_FLASH_RESULT_OK) {
-			return false;
-		}
+	uint32_t* words = reinterpret_cast<uint32_t*>(_data);
+	bool changed = false;
+	size_t pos = address;
+	size_t end = pos + length;
 
-		// write size
-		noInterrupts();
-		flashOk = spi_flash_write(_sector * SPI_FLASH_SEC_SIZE,
-				reinterpret_cast<uint32_t*>(&_size), 4);
-		interrupts();
-		if (flashOk != SPI_FLASH_RESULT_OK) {
-			return false;
+	while (pos < end) {
+		// merge the new bytes into a copy of the word so it can be compared in one go
+		uint16_t w = pos / 4;
+		size_t first = pos & 3;
+		size_t n = ((end - pos) < 4 - first) ? end - pos : 4 - first;
+		uint32_t word;
+		if (n == 4) {
+			if (src) {
+				memcpy(&word, src, 4);
+			} else {
+				word = val * 0x01010101UL;
+			}
+		} else {
+			word = words[w];
+			if (src) {
+				memcpy(reinterpret_cast<uint8_t*>(&word) + first, src, n);
+			} else {
+				memset(reinterpret_cast<uint8_t*>(&word) + first, val, n);
+			}
 		}
-
-		// read first 4 bytes of bitmap
-		noInterrupts();
-		spi_flash_read(_sector * SPI_FLASH_SEC_SIZE + 4,
-				reinterpret_cast<uint32_t*>(_bitmap), 4);
-		interrupts();
-
-		// init the rest of the _bitmap based on value of first byte
-		for (int i = 4; i < _bitmapSize; i++)
-			_bitmap[i] = _bitmap[0];
-
-		// all reset ok - point to where the data needs to go
-		_offset = 4 + _bitmapSize;
-	} else {
-		_offset += _size;
-	}
-
-	noInterrupts();
-	flashOk = spi_flash_write(_sector * SPI_FLASH_SEC_SIZE + _offset,
-			reinterpret_cast<uint32_t*>(_data), _size);
-	interrupts();
-
-	if (flashOk != SPI_FLASH_RESULT_OK) {
-		_offset = oldOffset;
-		return false;
+		if (src) {
+			src += n;
+		}
+		if (word != words[w]) {
+			words[w] = word;
+			if (_dirtyMap) {
+				_dirtyMap[w / 32] |= 1UL << (w & 31);
+			}
+			changed = true;
+		}
+		pos += n;
 	}
-
-	// Data written OK so need to update bitmap
-	int bitmapByteUpdated = flagUsedOffset();
-
-	bitmapByteUpdated &= ~3;    // align to 4 byte for write
-	noInterrupts();
-	flashOk = spi_flash_write(
-			_sector * SPI_FLASH_SEC_SIZE + bitmapByteUpdated + 4,
-			reinterpret_cast<uint32_t*>(&_bitmap[bitmapByteUpdated]), 4);
-	interrupts();
-	if (flashOk != SPI_FLASH_RESULT_OK) {
-		return false;
+	if (changed) {
+		markDirty(address, 0);   // the changed words are already flagged
 	}
-
-	// all good!
-	interrupts();
-	_dirty = false;
 	return true;
 }
 
 //------------------------------------------------------------------------------
 /**
- * Force an immediate erase of the flash sector - but nothing is written
+ * Find the next run of data in the buffer that has been changed since the last commit().
  *
- * The internal library variables & data are initialised (zeroed) but the commit() function must be called
- * to write structure (size and bitmap etc.) and any new data to the flash.
+ * Changes are tracked for each 4 byte word so the run is aligned to 4 bytes and may
+ * include bytes that were not changed.  A word that was changed and then put back
+ * to its original value is still included.
  *
- * @return True is success; false if the erase operation failed.
+ * e.g.
+ * + size_t len;
+ * + for (size_t a = EEPROM.dirtyRange(0, len); len; a = EEPROM.dirtyRange(a + len, len)) {...}
+ *
+ * @param from The offset in the buffer to start looking from
+ * @param length Set to the length of the run of changed data (0 if there is none)
+ * @return The offset of the start of the run or length() if there are no more changes
  */
-bool EEPROMClass::wipe() {
-	if (_size == 0 || _bitmapSize == 0)
-		return false;      // must have called begin()
+size_t EEPROMClass::dirtyRange(size_t from, size_t &length) {
+	uint16_t nWords = _size / 4;
+	uint16_t w = (from + 3) / 4;
 
-	// drop any old allocation and re-allocate buffers
-	if (_bitmap) {
-		delete[] _bitmap;
+	length = 0;
+	if (!_dirtyMap) {
+		return _size;
 	}
-	_bitmap = new uint8_t[_bitmapSize];
-	if (_data) {
-		delete[] _data;
+	while (w < nWords && !isWordDirty(w)) {
+		w++;
+	}
+	if (w >= nWords) {
+		return _size;
 	}
-	_data = new uint8_t[_size];
-
-	noInterrupts();
-	SpiFlashOpResult flashOk = spi_flash_erase_sector(_sector);
-	interrupts();
 
-	// flash is clear - need a commit() to write structure (size and bitmap etc.)
-	_dirty = true;
-	_offset = 0;
-	return (flashOk == SPI_FLASH_RESULT_OK);
+	uint16_t end = w + 1;
+	while (end < nWords && isWordDirty(end)) {
+		end++;
+	}
+	length = (end - w) * 4;
+	return w * 4;
 }
 
 //------------------------------------------------------------------------------
 /**
- * Compute the offset of the current version of data using the bitmap
+ * Flag the words of the buffer covering a range of addresses as changed.
  *
- * @return The offset of the current version of data
+ * @param address The offset of the first byte changed
+ * @param length The number of bytes changed
  */
-uint16_t EEPROMClass::offsetFromBitmap() {
-
-	if (!_bitmap || _bitmapSize <= 0)
-		return 0;
-
-	uint16_t offset = 4 + _bitmapSize;
-	boolean flash = (_bitmap[0] & 1); // true => 'after flash' state is 1 (else it must be 0)
-
-	// Check - the very first entry in the bitmap should indicate a valid _data
-	if ((flash && ((_bitmap[0] & 2) != 0))
-			|| (!flash && ((_bitmap[0] & 2) == 0))) {
-		// something's wrong - Bitmap doesn't have bit recording first data version
-		return 0;
+void EEPROMClass::markDirty(int const address, size_t length) {
+	_dirty = true;
+	if (_deferPending) {
+		_lastChange = millis();
 	}
-
-	for (int bmByte = 0; bmByte < _bitmapSize; bmByte++) {
-		for (int bmBit = (bmByte == 0) ? 4 : 1; bmBit < 0x0100; bmBit <<= 1) {
-			// looking for bit state that matches the 'after flash' state (i.e. first untouched bit)
-			if ((flash && ((_bitmap[bmByte] & bmBit) != 0))
-					|| (!flash && ((_bitmap[bmByte] & bmBit) == 0))) {
-				return offset; // offset pointed at last written
-			} else {
-				offset += _size;
-			}
-		}
+	if (!_dirtyMap || length == 0) {
+		return;
 	}
+	for (uint16_t w = address / 4; w <= (address + length - 1) / 4; w++) {
+		_dirtyMap[w / 32] |= 1UL << (w & 31);
+	}
+}
 
-	// dropped off the bottom - return the offset - but it will be useless
-	return offset;
+//------------------------------------------------------------------------------
+/**
+ * Mark the whole buffer as matching the flash.
+ */
+void EEPROMClass::clearDirty() {
+	_dirty = false;
+	if (_dirtyMap) {
+		memset(_dirtyMap, 0, ((_size / 4 + 31) / 32) * 4);
+	}
 }
 
 //------------------------------------------------------------------------------
 /**
- * Flag within the bitmap the appropriate bit for the current _data version at _offset
+ * Check if every changed word of the buffer still matches the copy in flash.
  *
- * @return The byte index within _bitmap that has been changed
+ * Only the changed words are read back so this is cheap compared with writing a new copy.
+ *
+ * @param canPatch If true on entry, set false unless the changed words could be written
+ * over the copy in flash
+ * @return True if the current flash copy already holds the buffered data.
  */
-int EEPROMClass::flagUsedOffset() {
-	int bitNo = 1 + (_offset - 4 - _bitmapSize) / _size;
-	int byteNo = bitNo >> 3;
+bool EEPROMClass::dirtyMatchesFlash(bool &canPatch) {
+	bool same = true;
+	size_t len;
 
-	uint8_t bitMask = 1 << (bitNo & 0x7);
-	if (_bitmap[0] & 1) {
-		// need to clear the bitmap bit
-		_bitmap[byteNo] &= ~bitMask;
-	} else {
-		// need to set the bitmap bit
-		_bitmap[byteNo] |= bitMask;
+	for (size_t addr = dirtyRange(0, len); len > 0 && (same || canPatch);
+			addr = dirtyRange(addr + len, len)) {
+		same = compareFlash(addr, len, canPatch) && same;
 	}
-
-	return byteNo;
+	return same;
 }
 
 //------------------------------------------------------------------------------
 /**
- * Compute size of bitmap needed for the number of copies that can be held
+ * Compare part of the buffer with the latest copy in flash.
  *
- * @param size The size of the EEPROM required
- * @return Number of bytes required for the bitmap
+ * A word can be written over the flash if it only needs bits to move further from their
+ * erased state - i.e. with the usual polarity, if it only clears bits.
+ *
+ * @param pos The offset in the buffer (a multiple of 4)
+ * @param length The number of bytes (a multiple of 4)
+ * @param canPatch If true on entry, set false unless every word could be written over the flash
+ * @return True if the flash already holds the same data
  */
-uint16_t EEPROMClass::computeBitmapSize(size_t size) {
-
-	// With 1 bit in bitmap and 8 bits per byte
-	// This is the max number of copies possible
-	uint32_t nCopies = ((SPI_FLASH_SEC_SIZE - 4L) * 8L - 1L) / (size * 8L + 1L);
+bool EEPROMClass::compareFlash(uint16_t pos, uint16_t length, bool &canPatch) {
+	uint32_t buf[16];
+	const uint32_t* now = reinterpret_cast<const uint32_t*>(_data);
+	uint32_t erased = (sealed() || (_bitmap[0] & 1)) ? 0xffffffff : 0;
+	bool same = true;
 
-	// applying alignment constraints - this is the bitmap size needed
-	uint32_t bitmapSize = (((nCopies + 1L) + 31L) / 8L) & ~3;
+	for (uint16_t end = pos + length; pos < end && (same || canPatch); pos += sizeof(buf)) {
+		uint16_t chunk = end - pos;
+		if (chunk > sizeof(buf)) {
+			chunk = sizeof(buf);
+		}
+		flashRead(_offset + pos, buf, chunk);
+		for (uint16_t i = 0; i < chunk / 4; i++) {
+			uint32_t want = now[pos / 4 + i];
+			if (want != buf[i]) {
+				same = false;
+				uint32_t was = buf[i] ^ erased;
+				if (((want ^ erased) & was) != was) {
+					canPatch = false;   // would need a bit put back to its erased state
+				}
+			}
+		}
+	}
+	return same;
+}
 
-	return bitmapSize & 0x7fff;
+//------------------------------------------------------------------------------
+/**
+ * Perform an erase of the flash sector before committing the data
+ *
+ * @return True is all OK; false if there was a problem.
+ */
+bool EEPROMClass::commitReset() {
+	if (viewing()) {
+		unview();
+	}
+	// set an offset that ensures flash will be erased before commit
+	finishCommit();
+	if (_rtcOnly) {
+		loadFlash();
+	}
+	_offset = SPI_FLASH_SEC_SIZE;
+	_dirty = true;                  // ensure writing takes place
+	if (!startCommit(false)) {
+		return false;
+	}
+	return finishCommit();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write the EEPROM data to the flash memory.
+ *
+ * The flash segment for EEPROM data is erased if necessary before performing the write.
+ * The library maintains a record of whether the buffer has been changed and the write
+ * to flash is only performed if the flash does not yet have a copy of the data or
+ * if the data in the buffer has changed from what is stored in the flash memory.
+ *
+ * This waits for the whole commit to complete; use commitAsync() to spread the work out.
+ *
+ * @return True if successful (or if no write was needed); false if the write was unsuccessful.
+ */
+bool EEPROMClass::commit() {
+	// finish off any commit already on its way - the buffer may have changed since it started
+	finishCommit();
+	if (!commitAsync()) {
+		return false;
+	}
+	return finishCommit();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Start writing the EEPROM data to the flash memory without waiting for it to complete.
+ *
+ * The work is done in small steps by calling poll() - each call does at most one flash
+ * operation (an erase of the sector or the write of one chunk, see setWriteChunk()) so the
+ * time interrupts are held off in any one call is limited.
+ * Until the commit is complete the previous copy in flash is still the one begin() will find.
+ *
+ * Changes made to the buffer while a commit is in progress are kept for the next commit(),
+ * but they may also be partly included in this one.
+ *
+ * e.g.
+ * + EEPROM.commitAsync();
+ * + while (EEPROM.poll() == EEPROM_ERASING || EEPROM.status() == EEPROM_WRITING) {...}
+ *
+ * @see poll()
+ *
+ * @return True if the commit was started (or no write was needed); false if the library
+ * has not been initialised with begin().
+ */
+bool EEPROMClass::commitAsync() {
+	return startCommit(true);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Ask for a commit once the data has stopped changing, so that a burst of changes (each
+ * followed by a commit request) only writes the flash once.
+ *
+ * The commit is started by poll() when there have been no changes for quietMs, or at the
+ * latest maxDelayMs after the first request that is still waiting.  Call poll() regularly,
+ * e.g. from loop(), as for commitAsync().  A commit(), commitAsync() or another
+ * commitDeferred() before then takes the place of the waiting one and is counted in
+ * counters().commitsCoalesced.
+ *
+ * e.g.
+ * + EEPROM.put(0, settings);
+ * + EEPROM.commitDeferred(5000);
+ * + ... and in loop(): EEPROM.poll();
+ *
+ * @param maxDelayMs The longest the commit may wait
+ * @param quietMs How long there must be no changes before the commit is done
+ */
+void EEPROMClass::commitDeferred(uint32_t maxDelayMs, uint32_t quietMs) {
+	uint32_t now = millis();
+	if (_deferPending) {
+		_counters.commitsCoalesced++;
+		// the earlier deadline stands
+		if (now - _deferStart + maxDelayMs < _deferMax) {
+			_deferMax = now - _deferStart + maxDelayMs;
+		}
+	} else {
+		_deferPending = true;
+		_deferStart = now;
+		_deferMax = maxDelayMs;
+	}
+	_deferQuiet = quietMs;
+	_lastChange = now;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write the EEPROM data to the flash now, even if the RTC memory tier would hold it back.
+ *
+ * @see setRtcTier()
+ *
+ * @return True if successful (or if no write was needed); false if the write was unsuccessful.
+ */
+bool EEPROMClass::flush() {
+	finishCommit();
+	if (!startCommit(false)) {
+		return false;
+	}
+	return finishCommit();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Start a commit - see commitAsync().
+ *
+ * @param useRtc Hold the data in RTC memory instead if the RTC memory tier allows
+ * @return True if the commit was started (or no write was needed)
+ */
+bool EEPROMClass::startCommit(bool useRtc) {
+	if (_deferPending) {
+		_deferPending = false;  // this commit covers it
+		_counters.commitsCoalesced++;
+	}
+	if (viewing()) {
+		_status = EEPROM_DONE;  // nothing can have changed
+		return true;
+	}
+	// everything has to be in place to even try a commit
+	if (!_size || !_data || !_bitmap || _slotSize == 0) {
+		return false;
+	}
+	if (committing()) {
+		return true;
+	}
+	_irqOffMax = 0;
+	if (useRtc && stageRtc()) {
+		return true;
+	}
+	if (_rtcOnly && (_dirty || _rtcPending)) {
+		loadFlash();    // need to know what is in the flash now
+	}
+	if (_rtcPending) {
+		markDirty(0, _size);    // the flash is behind the RTC copy
+	}
+	if (!_dirty) {
+		_status = EEPROM_DONE;
+		return true;
+	}
+	if (_mode & EEPROM_MODE_DELTA) {
+		return startDelta();
+	}
+
+	// the changes can only be compared with, or written over, the copy that was loaded
+	if (_offset != 0 && !_offsetDamaged && _offset + _slotSize <= SPI_FLASH_SEC_SIZE) {
+		bool canPatch = _inPlace && !hasCrc();
+		// a different hash means the data has changed - then the flash is only read to see if
+		// the changes can be written in place
+		bool same = !_hashValid || crc32(0, _data, _size) == _hash;
+		if ((same || canPatch) && dirtyMatchesFlash(canPatch)) {
+			// the changes have all been put back so there is nothing to write
+			clearDirty();
+			if (_rtcPending) {
+				_rtcPending = 0;
+				if (rtcTier()) {
+					writeRtc();
+				}
+			}
+			_counters.commitsSkipped++;
+			_status = EEPROM_DONE;
+			return true;
+		}
+		if (canPatch) {
+			// changed words are cleared from the dirty map as they are written
+			clearHint();
+			_dirty = false;
+			_commitErase = false;
+			_writeDone = 0;
+			_step = STEP_PATCH;
+			_status = EEPROM_WRITING;
+			return true;
+		}
+	}
+	startCopy();
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Set up a commit of a new full copy of the data.
+ */
+void EEPROMClass::startCopy() {
+	// changes made from now on are for the next commit
+	clearHint();
+	clearDirty();
+	_writeDone = 0;
+	_crc = 0;
+
+	// If initial version or not enough room for new version, erase and start anew
+	if (_offset == 0 || _offset + _slotSize + _slotSize > _end) {
+		_commitErase = true;
+		_step = STEP_ERASE;
+		_status = EEPROM_ERASING;
+	} else {
+		_commitErase = false;
+		_commitOffset = _offset + _slotSize;
+		_step = STEP_DATA;
+		_status = EEPROM_WRITING;
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Do the next step of a commit started by commitAsync().
+ *
+ * Call this regularly, e.g. from loop(), until the status is no longer EEPROM_ERASING or
+ * EEPROM_WRITING.  It returns straight away if there is no commit in progress, unless a
+ * commit asked for by commitDeferred() is due, which it then starts.
+ *
+ * @return The status of the commit after this step
+ */
+EEPROMStatus EEPROMClass::poll() {
+	if (!committing()) {
+		uint32_t now = millis();
+		if (_deferPending && (now - _lastChange >= _deferQuiet || now - _deferStart >= _deferMax)) {
+			_deferPending = false;
+			commitAsync();
+		}
+		return status();
+	}
+
+	bool delta = (_mode & EEPROM_MODE_DELTA);
+	bool ok = true;
+
+	switch (_step) {
+	case STEP_ERASE:
+		// with several sectors, move on to the next one - it may already be erased
+		_prevSector = _sector;
+		if (_sectorCount > 1) {
+			_sector = nextSector();
+			_generation++;
+		}
+		ok = _nextErased || eraseIfNeeded(_sector);
+		_nextErased = false;
+		_stats.slot = 0;
+		_status = EEPROM_WRITING;
+		_commitOffset = 4;  // in delta mode the checkpoint goes first, the size is written last
+		if (_end < SPI_FLASH_SEC_SIZE) {
+			_step = STEP_STATS;
+		} else {
+			_step = delta ? STEP_DATA : STEP_SIZE;
+		}
+		break;
+
+	case STEP_STATS: {
+		uint32_t saved[4] = { STATS_MAGIC, _stats.erases, _stats.commits, _stats.bytesWritten };
+		ok = flashWrite(SPI_FLASH_SEC_SIZE - STATS_SIZE, saved, STATS_SIZE);
+		_step = delta ? STEP_DATA : STEP_SIZE;
+		break;
+	}
+
+	case STEP_SIZE: {
+		uint32_t header = _size | _mode | (static_cast<uint32_t>(_generation) << 24);
+		ok = flashWrite(0, &header, 4);
+		if (ok && delta) {
+			endCommit(4 + _size);
+		} else if (ok && sealed()) {
+			_commitOffset = 4;
+			_step = STEP_DATA;
+		} else if (ok) {
+			// read first 4 bytes of bitmap
+			ok = flashRead(4, _bitmap, 4);
+
+			// init the rest of the _bitmap based on value of first byte
+			for (int i = 4; i < _bitmapSize; i++)
+				_bitmap[i] = _bitmap[0];
+
+			// all reset ok - point to where the data needs to go
+			_commitOffset = 4 + _bitmapSize;
+			_step = STEP_DATA;
+		}
+		break;
+	}
+
+	case STEP_DATA: {
+		// delta mode writes the checkpoint from the committed copy
+		const uint8_t* src = delta ? _shadow : _data;
+		uint16_t length = _size;
+		if (!delta && _writeDone == 0 && !isErased(_sector, _commitOffset, _slotSize)) {
+			// left part written by an interrupted commit - writing over it would only clear
+			// more bits, so abandon it
+			if (sealed()) {
+				// seals can skip a slot
+				uint32_t zero = 0;
+				ok = flashWrite(_commitOffset + _size, &zero, 4);
+				_commitOffset += _slotSize;
+			}
+			if (!sealed() || _commitOffset + _slotSize > _end) {
+				// the bitmap can't skip a slot so start again in an erased sector
+				_commitErase = true;
+				_step = STEP_ERASE;
+				_status = EEPROM_ERASING;
+			}
+			break;
+		}
+		if (sealed()) {
+			// the seal goes in the same write, after the data
+			uint32_t seal = SEAL_TAG | ((_commitOffset - 4) / _slotSize);
+			memcpy(_data + _size, &seal, 4);
+			length = _slotSize;
+		}
+
+		uint16_t chunk = length - _writeDone;
+		if (chunk > _chunk) {
+			chunk = _chunk;
+		}
+		ok = flashWrite(_commitOffset + _writeDone, src + _writeDone, chunk);
+		if (!delta && _writeDone < _size) {
+			// CRC of exactly what was written, even if the buffer changes later on
+			_crc = crc32(_crc, src + _writeDone, (chunk < _size - _writeDone) ? chunk : _size - _writeDone);
+		}
+		_writeDone += chunk;
+		if (_writeDone < length) {
+			break;
+		} else if (delta) {
+			_step = STEP_SIZE;
+		} else if (hasCrc()) {
+			_step = STEP_CRC;
+		} else if (sealed()) {
+			if (ok) {
+				endCommit(_commitOffset);
+			}
+		} else {
+			_step = STEP_MARK;
+		}
+		break;
+	}
+
+	case STEP_CRC:
+		ok = flashWrite(_commitOffset + _size, &_crc, 4);
+		_step = STEP_MARK;
+		break;
+
+	case STEP_PATCH: {
+		size_t length;
+		size_t pos = dirtyRange(_writeDone, length);
+		if (length == 0) {
+			_counters.slotAdvancesSaved++;
+			endCommit(_offset);
+			break;
+		}
+		if (length > _chunk) {
+			length = _chunk;
+		}
+
+		// the buffer may have changed again since the commit started
+		bool canPatch = true;
+		compareFlash(pos, length, canPatch);
+		if (!canPatch) {
+			startCopy();
+			break;
+		}
+
+		ok = flashWrite(_offset + pos, _data + pos, length);
+		for (uint16_t w = pos / 4; w < (pos + length) / 4; w++) {
+			_dirtyMap[w / 32] &= ~(1UL << (w & 31));
+		}
+		_writeDone = pos + length;
+		break;
+	}
+
+	case STEP_MARK: {
+		// Data written OK so need to update bitmap
+		int bitmapByteUpdated = flagUsedOffset(_commitOffset);
+
+		bitmapByteUpdated &= ~3;    // align to 4 byte for write
+		ok = flashWrite(bitmapByteUpdated + 4, &_bitmap[bitmapByteUpdated], 4);
+		if (ok) {
+			endCommit(_commitOffset);
+		}
+		break;
+	}
+
+	case STEP_RECORD: {
+		uint16_t length = _rangeCount * 4;
+		uint16_t chunk = length - _writeDone;
+		if (chunk > _chunk) {
+			chunk = _chunk;
+		}
+		ok = flashWrite(_commitOffset + 4 + _writeDone, _shadow + _rangeStart * 4 + _writeDone,
+				chunk);
+		_writeDone += chunk;
+		if (_writeDone >= length) {
+			_step = STEP_RECORD_HEADER;
+		}
+		break;
+	}
+
+	case STEP_RECORD_HEADER: {
+		// the header of the last record of the commit is flagged
+		uint16_t nextStart, nextCount;
+		bool more = nextChangedRange(_rangeStart + _rangeCount, nextStart, nextCount);
+		uint32_t header = DELTA_TAG | (more ? 0 : DELTA_LAST) | (_rangeCount << 10)
+				| _rangeStart;
+		ok = flashWrite(_commitOffset, &header, 4);
+		_commitOffset += 4 + _rangeCount * 4;
+		if (ok && more) {
+			ok = startRecord(nextStart, nextCount);
+		} else if (ok) {
+			endCommit(_commitOffset);
+		}
+		break;
+	}
+	}
+
+	if (!ok) {
+		failCommit();
+	}
+	return status();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the progress of the last commit.
+ *
+ * @return EEPROM_ERASING or EEPROM_WRITING while a commit is in progress, EEPROM_DONE or
+ * EEPROM_FAILED for the result of the last commit, or EEPROM_IDLE if there has not been one.
+ */
+EEPROMStatus EEPROMClass::status() {
+	return static_cast<EEPROMStatus>(_status);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get counts of what the library has done to the flash since start-up.
+ *
+ * @return The counters
+ */
+const EEPROMCounters& EEPROMClass::counters() {
+	return _counters;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get lifetime statistics of the EEPROM flash, e.g. to predict when it will wear out.
+ *
+ * The totals are saved in the sector each time it is erased.  After a restart the commits
+ * and bytes written since the last erase are estimated from how full the sector is.
+ * With a ring of sectors (see setSectors()) the totals are for all of them together; an
+ * erase done ahead of time by maintain() is only saved once the data moves to that sector.
+ * The statistics are not kept if the data takes up most of the sector.
+ *
+ * @param stats Set to the statistics
+ */
+void EEPROMClass::getStats(EEPROMStats &stats) {
+	if (_rtcOnly) {
+		loadFlash();
+	}
+	uint32_t rated = EEPROM_FLASH_ENDURANCE * _sectorCount;
+	stats = _stats;
+	stats.remainingErases = (_stats.erases < rated) ? rated - _stats.erases : 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Set the most data written to flash in one go during a commit.
+ *
+ * Interrupts are held off for each flash write so smaller chunks keep that time short
+ * (about 1ms per 256 bytes) at the cost of a slightly slower commit overall.  Interrupts
+ * are enabled again between chunks.
+ * An erase of the sector cannot be split up and will still hold interrupts off for
+ * several 10s of ms.
+ *
+ * @see maxInterruptsOff()
+ *
+ * @param bytes Bytes per write - rounded down to a multiple of 4 (default EEPROM_WRITE_CHUNK)
+ * @param yieldBetween If true commit() calls yield() between chunks.  Only use this if
+ * commit() is never called from a timer or interrupt callback.
+ */
+void EEPROMClass::setWriteChunk(size_t bytes, bool yieldBetween) {
+	bytes &= ~3;
+	if (bytes < 4) {
+		bytes = 4;
+	} else if (bytes > SPI_FLASH_SEC_SIZE) {
+		bytes = SPI_FLASH_SEC_SIZE;
+	}
+	_chunk = bytes;
+	_yield = yieldBetween;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the longest time interrupts were held off for a single flash operation during the
+ * last commit.
+ *
+ * @return The time in microseconds
+ */
+uint32_t EEPROMClass::maxInterruptsOff() {
+	return _irqOffMax;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+/**
+ * Force an immediate erase of the flash sector - but nothing is written
+ *
+ * The internal library variables & data are initialised (zeroed) but the commit() function must be called
+ * to write structure (size and bitmap etc.) and any new data to the flash.
+ *
+ * @return True is success; false if the erase operation failed.
+ */
+bool EEPROMClass::wipe() {
+	if (_size == 0 || _slotSize == 0)
+		return false;      // must have called begin()
+	if (viewing())
+		unview();
+
+	// the bitmap is set up again by the next commit
+	memset(_data, 0, _slotSize);
+	if (_shadow) {
+		memset(_shadow, 0, _size);
+	}
+
+	bool flashOk = true;
+	for (uint8_t i = 0; i < _sectorCount; i++) {
+		flashOk = eraseIfNeeded(_firstSector + i) && flashOk;
+	}
+	_sector = _firstSector;
+	_generation = 0;
+	_nextErased = (_sectorCount > 1) && flashOk;
+	_stats.slot = 0;
+	_rtcOnly = false;
+	_rtcPending = 0;
+	_hashValid = false;
+	clearHint();
+	if (rtcTier()) {
+		uint32_t none = 0;
+		system_rtc_mem_write(RTC_USER_BLOCK + _rtcBlock, &none, 4);  // RTC copy is out of date
+	}
+
+	// flash is clear - need a commit() to write structure (size and bitmap etc.)
+	_status = EEPROM_IDLE;
+	clearDirty();
+	_dirty = true;
+	_offset = 0;
+	return flashOk;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Use a buffer provided by the caller (e.g. by StaticEEPROM) instead of allocating one in
+ * begin().
+ *
+ * @param buffer The buffer (4 byte aligned) or 0 to go back to allocating one
+ * @param length The size of the buffer - at least bufferSize() for the size and mode
+ */
+void EEPROMClass::useBuffer(uint8_t* buffer, size_t length) {
+	if (_ownsBuffer && _buffer) {
+		delete[] _buffer;
+	}
+	_buffer = buffer;
+	_bufferLength = buffer ? length : 0;
+	_ownsBuffer = !buffer;
+	_data = 0;
+	_view = 0;
+	_bitmap = 0;
+	_dirtyMap = 0;
+	_shadow = 0;
+	_size = 0;
+	_loaded = false;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Select how the data is held in the flash sector.
+ *
+ * The mode takes effect at the next begin() and is recorded in the flash sector along with
+ * the size; if the flash was written using a different mode then begin() treats it the same
+ * way as a change of size.
+ *
+ * - EEPROM_MODE_COPY (default) - each commit() writes a full copy of the data.
+ * - EEPROM_MODE_DELTA - each commit() appends only the words that have changed since the
+ *   last commit.  This suits larger data where only a small part changes each time, but it
+ *   keeps a second copy of the data in RAM to find the changes.
+ * - EEPROM_MODE_CRC - add to EEPROM_MODE_COPY to store a CRC32 with each copy.  If power is
+ *   lost (or the flash goes bad) and the latest copy does not match its CRC then begin()
+ *   loads the newest copy that does.  Each copy takes 4 bytes more of the sector.
+ *   It has no effect with EEPROM_MODE_DELTA or EEPROM_MODE_SEALED.
+ * - EEPROM_MODE_SEALED - like EEPROM_MODE_COPY but each copy carries its own marker instead
+ *   of a bitmap, so a commit() that doesn't need an erase is a single flash write (as long as
+ *   the copy fits in one write chunk, see setWriteChunk()).
+ *
+ * @param mode One of the EEPROM_MODE_xxx values
+ */
+void EEPROMClass::setMode(uint32_t mode) {
+	if (mode != _mode) {
+		_loaded = false;
+	}
+	_mode = mode;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Allow commit() to write changes over the latest copy instead of writing a new copy.
+ *
+ * Flash bits can be programmed without an erase, just not put back (with the usual polarity
+ * a 1 can be cleared to 0 but not set again).  So when every change only clears bits - e.g.
+ * setting flags or counting down a unary counter - the changed words are rewritten in place
+ * and the copy does not use up another slot of the sector.
+ *
+ * If power is lost part way through such a commit, the copy in flash can hold some of the
+ * changes but not others.  It has no effect with EEPROM_MODE_DELTA or EEPROM_MODE_CRC.
+ *
+ * @see counters()
+ *
+ * @param enable True to allow rewriting in place
+ */
+void EEPROMClass::setInPlace(bool enable) {
+	_inPlace = enable;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read the data straight from the flash instead of keeping a copy of it in RAM.
+ *
+ * For data that is mostly only read, e.g. calibration tables: begin() just finds the
+ * latest copy in the flash (only the bitmap needs a buffer) and read(), get() and view()
+ * then read it through the memory mapped flash window.
+ * The first write() or put() (or wipe() or commitReset()) switches back to the normal
+ * buffered mode, reading the data into a buffer from the flash.
+ *
+ * Only the first 1MB of the flash is mapped - sectors beyond that, and EEPROM_MODE_DELTA,
+ * are always buffered.  So is data of another size, which begin() migrates as usual.
+ * Call this before begin().
+ *
+ * @param enable True to read through the mapped flash
+ */
+void EEPROMClass::setReadOnly(bool enable) {
+	if (enable != _readOnly) {
+		_loaded = false;
+	}
+	_readOnly = enable;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Set a function for begin() to call when it has loaded data of a different size.
+ *
+ * The data that fits has already been copied into the buffer (and the rest zeroed) so the
+ * function only needs to fix up anything that has moved or needs a default value.
+ * The changes are written to the flash by the next commit().
+ * Call this before begin().
+ *
+ * e.g.
+ * + void upgrade(uint8_t* data, size_t oldSize, size_t newSize) {
+ * +     if (oldSize < offsetof(Config, timeout) + 4) ((Config*) data)->timeout = 30;
+ * + }
+ * + EEPROM.setMigration(upgrade);
+ *
+ * @param migration The function, or null for none
+ */
+void EEPROMClass::setMigration(EEPROMMigration migration) {
+	_migration = migration;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Hold committed data in the esp8266's RTC memory, which survives deep sleep, and only
+ * write it to the flash every few commits.
+ *
+ * For devices that wake from deep sleep, change a little and commit() each time: commit()
+ * saves the data with a CRC in the RTC memory and only every flushEvery'th commit goes on
+ * to write the flash.  Commits that change nothing (such as the one in end() after a
+ * commit()) do not count.  begin() loads a good RTC copy without reading the flash; after a
+ * power cut the RTC copy is lost and begin() reads the flash as usual (so the commits held
+ * only in RTC memory are lost too).  flush(), commitReset() and maintain() always write the
+ * flash.
+ *
+ * The data plus 16 bytes must fit in the EEPROM_RTC_SIZE bytes of user RTC memory from the
+ * block given - otherwise every commit writes the flash as normal.
+ * After begin() has loaded the RTC copy, the first call of percentUsed(), commitsUntilErase(),
+ * getStats() or maintain() reads the flash to find out how full it is.
+ * Call this before begin().
+ *
+ * @param flushEvery Write the flash on every flushEvery'th commit (0 for no RTC tier)
+ * @param block The 4 byte block of user RTC memory to start at (0 - 127) - to leave room
+ * for other users
+ */
+void EEPROMClass::setRtcTier(uint16_t flushEvery, uint8_t block) {
+	if (flushEvery != _rtcFlushEvery || block != _rtcBlock) {
+		_loaded = false;
+	}
+	_rtcFlushEvery = flushEvery;
+	_rtcBlock = block;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Keep a note of where the latest copy is in the esp8266's RTC memory, which survives deep
+ * sleep, so that begin() can go straight to it.
+ *
+ * The note is checked against the size word and the bitmap word (or seals) around the copy,
+ * so begin() needs only a couple of small reads before the data instead of a search of the
+ * bitmap (or of every sector of a ring).  It is cleared whenever a commit starts writing and
+ * written again when it finishes.  It has no effect in EEPROM_MODE_DELTA.
+ * Call this before begin().
+ *
+ * @param enable True to keep the note
+ * @param block The 4 byte block of user RTC memory to keep it in (0 - 123, it takes 5) -
+ * the default is the end of the user RTC memory, clear of setRtcTier() for up to 476 bytes
+ */
+void EEPROMClass::setRtcHint(bool enable, uint8_t block) {
+	if (enable != _rtcHint || block != _rtcHintBlock) {
+		_loaded = false;
+	}
+	_rtcHint = enable;
+	_rtcHintBlock = block;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the EEPROM data without copying it.
+ *
+ * In read-only mode (see setReadOnly()) this points into the memory mapped flash which, on
+ * the esp8266, can only be read 4 bytes at a time (e.g. with memcpy_P() or pgm_read_dword()).
+ * Otherwise it is the library's buffer.
+ *
+ * @return The data, or null if there is none (e.g. the flash did not hold a good copy in
+ * read-only mode)
+ */
+const uint8_t* EEPROMClass::view() {
+	return _data ? _data : _view;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Leave read-only mode, reading the data into a buffer so it can be changed.
+ */
+void EEPROMClass::unview() {
+	_readOnly = false;
+	_loaded = false;
+	begin(_size);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Copy data out of the mapped flash using only aligned 4 byte reads.
+ *
+ * @param address The offset in the EEPROM data
+ * @param buf Where to put the data
+ * @param length The number of bytes
+ */
+void EEPROMClass::readView(int address, void* buf, size_t length) {
+	const uint32_t* words = reinterpret_cast<const uint32_t*>(_view);
+	uint8_t* out = static_cast<uint8_t*>(buf);
+	uint32_t word = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		size_t pos = address + i;
+		if (i == 0 || (pos & 3) == 0) {
+			word = words[pos / 4];
+		}
+		out[i] = word >> ((pos & 3) * 8);
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the address of a position in the current sector in the memory mapped flash.
+ *
+ * @param pos The offset in the sector
+ * @return The address
+ */
+const uint8_t* EEPROMClass::mappedFlash(uint16_t pos) {
+#ifdef ESP_EEPROM_HOST
+	return flashSim().mem + _sector * SPI_FLASH_SEC_SIZE + pos;
+#else
+	return reinterpret_cast<const uint8_t*>(0x40200000 + _sector * SPI_FLASH_SEC_SIZE + pos);
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Use a ring of consecutive flash sectors instead of a single sector.
+ *
+ * When a sector is full the data moves on to the next sector of the ring.  That sector can
+ * be erased beforehand at a convenient time with maintain(), so the move only needs a write.
+ * Older sectors are left alone until the data comes round to them again, which also spreads
+ * the wear over all the sectors.
+ * Each sector records a generation number with the size so that begin() can find the newest.
+ *
+ * The sectors must not be used for anything else - by default the sectors just before the
+ * EEPROM sector belong to the file system so that would have to be made smaller.
+ * Call this before begin().
+ *
+ * @param firstSector The first flash sector of the ring
+ * @param count The number of sectors (1 - 127)
+ */
+void EEPROMClass::setSectors(uint32_t firstSector, uint8_t count) {
+	if (count < 1) {
+		count = 1;
+	} else if (count > 127) {
+		count = 127;
+	}
+	_loaded = false;
+	_firstSector = firstSector;
+	_sectorCount = count;
+	_sector = firstSector;
+	_prevSector = firstSector;
+	_generation = 0;
+	_nextErased = false;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Find the sector holding the latest data of the right size and mode.
+ *
+ * With a ring of sectors the first 8 bytes of each are read and the newest generation that
+ * holds a complete copy of the data is chosen - unless a newer sector holds data of another
+ * size, which begin() then migrates.
+ *
+ * @param header Set to the size word and the first bitmap word of the sector
+ * @return True if a suitable sector was found.
+ */
+bool EEPROMClass::findSector(uint32_t* header) {
+	uint32_t want = _size | _mode;
+
+	if (_sectorCount <= 1) {
+		flashRead(0, header, 8);
+		return header[0] == want;
+	}
+
+	bool found = false;
+	bool foundOther = false;
+	uint8_t otherGeneration = 0;
+	uint32_t best = _firstSector;
+	for (uint8_t i = 0; i < _sectorCount; i++) {
+		uint32_t h[2];
+		_sector = _firstSector + i;
+		flashRead(0, h, 8);
+		uint32_t size = h[0] & 0xffff;
+		if ((h[0] & 0x00ff0000) != _mode || size < EEPROM_MIN_SIZE
+				|| size > SPI_FLASH_SEC_SIZE - 8 || (size & 3)) {
+			continue;
+		}
+
+		// a copy is only complete once the bitmap has its first bit flagged
+		// (in delta mode the size word is written last)
+		uint32_t erased = (h[1] & 1) ? 0xffffffff : 0;
+		if (sealed()) {
+			uint32_t seal;
+			flashRead(4 + size, &seal, 4);
+			if (seal != SEAL_TAG) {
+				continue;   // first slot has not been sealed
+			}
+		} else if (!(_mode & EEPROM_MODE_DELTA) && ((h[1] ^ erased) & 2) == 0) {
+			continue;
+		}
+
+		uint8_t gen = h[0] >> 24;
+		if ((h[0] & 0x00ffffff) != want) {
+			// data of another size - only wanted if it is newer (see migrate())
+			if (!foundOther || static_cast<int8_t>(gen - otherGeneration) > 0) {
+				foundOther = true;
+				otherGeneration = gen;
+			}
+		} else if (!found || static_cast<int8_t>(gen - _generation) > 0) {
+			found = true;
+			best = _sector;
+			_generation = gen;
+			header[0] = h[0];
+			header[1] = h[1];
+		}
+	}
+
+	_sector = best;
+	_prevSector = best;
+	return found && !(foundOther && static_cast<int8_t>(otherGeneration - _generation) > 0);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the sector after the current one in the ring.
+ *
+ * @return The sector number
+ */
+uint32_t EEPROMClass::nextSector() {
+	return _firstSector + (_sector - _firstSector + 1) % _sectorCount;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Erase the sector the data will move to next, if not already done.
+ *
+ * @return True if the sector is ready for use.
+ */
+bool EEPROMClass::eraseNextSector() {
+	if (!_nextErased) {
+		_nextErased = eraseIfNeeded(nextSector());
+	}
+	return _nextErased;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Start a commit in EEPROM_MODE_DELTA by appending records for the changed words to the log.
+ *
+ * All the records for one commit are written before the header of the last one
+ * (which is flagged) so an interrupted commit is ignored by begin().
+ * If the log is full, or the space after it is not clean, the sector is compacted
+ * back to a single checkpoint.
+ *
+ * @return True if the commit was started (or no write was needed).
+ */
+bool EEPROMClass::startDelta() {
+	if (!_shadow) {
+		return false;
+	}
+
+	_writeDone = 0;
+	if (_offset != 0 && _offset < SPI_FLASH_SEC_SIZE) {
+		// work out how much log space the changes need
+		uint32_t needed = 0;
+		uint16_t start, count;
+		uint16_t next = 0;
+		while (nextChangedRange(next, start, count)) {
+			needed += 4 + count * 4;
+			next = start + count;
+		}
+		if (needed == 0) {
+			// buffer changed but has been put back the way it was
+			clearDirty();
+			_status = EEPROM_DONE;
+			return true;
+		}
+		if (_offset + needed <= _end && isErased(_sector, _offset, needed)) {
+			_commitErase = false;
+			_commitOffset = _offset;
+			nextChangedRange(0, start, count);
+			_status = EEPROM_WRITING;
+			if (!startRecord(start, count)) {
+				failCommit();
+			}
+			return true;
+		}
+	}
+
+	// compact to a new checkpoint of the data as it is now
+	memcpy(_shadow, _data, _size);
+	clearDirty();
+	_commitErase = true;
+	_step = STEP_ERASE;
+	_status = EEPROM_ERASING;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Set up the write of the next EEPROM_MODE_DELTA record.
+ *
+ * The words are copied to the committed copy first and written from there, so later
+ * changes to the buffer are left for the next commit.
+ *
+ * @param start The word index of the first changed word
+ * @param count The number of words
+ * @return False if there is no clean space left for the record.
+ */
+bool EEPROMClass::startRecord(uint16_t start, uint16_t count) {
+	uint16_t length = 4 + count * 4;
+	if (_commitOffset + length > _end
+			|| !isErased(_sector, _commitOffset, length)) {
+		return false;
+	}
+
+	memcpy(_shadow + start * 4, _data + start * 4, count * 4);
+	for (uint16_t w = start; w < start + count; w++) {
+		_dirtyMap[w / 32] &= ~(1UL << (w & 31));
+	}
+
+	_rangeStart = start;
+	_rangeCount = count;
+	_writeDone = 0;
+	_step = STEP_RECORD;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Poll until any commit in progress is complete.
+ *
+ * @return False if the last commit failed.
+ */
+bool EEPROMClass::finishCommit() {
+	while (committing()) {
+		poll();
+		if (_yield && committing()) {
+			yield();
+		}
+	}
+	return _status != EEPROM_FAILED;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Record the successful end of a commit.
+ *
+ * @param offset The new offset of the latest data in the sector
+ */
+void EEPROMClass::endCommit(uint16_t offset) {
+	_stats.commits++;
+	if (offset != _offset || _commitErase) {
+		_stats.slot++;  // not rewritten in place
+	}
+	_offset = offset;
+	_offsetDamaged = false;
+	_status = EEPROM_DONE;
+
+	if (_mode & EEPROM_MODE_DELTA) {
+		// still dirty if the buffer has moved on from the committed copy
+		uint16_t start, count;
+		if (!nextChangedRange(0, start, count)) {
+			clearDirty();
+		}
+	}
+
+	if (!(_mode & EEPROM_MODE_DELTA)) {
+		// remember what the flash now holds so a commit of the same data can be skipped
+		if (_step != STEP_PATCH) {
+			_hash = _crc;
+			_hashValid = true;
+		} else {
+			size_t len;
+			dirtyRange(0, len);
+			_hashValid = (len == 0);    // unless it changed again behind the patch
+			_hash = crc32(0, _data, _size);
+		}
+	}
+
+	if (rtcTier() && _data) {
+		_rtcPending = _dirty ? 1 : 0;
+		writeRtc();
+	} else {
+		_rtcPending = 0;
+	}
+	writeHint();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Record the failure of a commit.
+ *
+ * The next commit will always write everything and will erase the sector first as the
+ * area being written to can no longer be trusted.
+ */
+void EEPROMClass::failCommit() {
+	_status = EEPROM_FAILED;
+	markDirty(0, _size);
+	_hashValid = false;
+
+	if (_commitErase && _sector != _prevSector) {
+		// the data in the previous sector is still good
+		_sector = _prevSector;
+		_generation--;
+		_offset = SPI_FLASH_SEC_SIZE;
+	} else {
+		// offset of zero => flash data is garbage
+		_offset = _commitErase ? 0 : SPI_FLASH_SEC_SIZE;
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Set the size of the data and where the copies of that size go in a sector.
+ *
+ * @param size The size of the data (a multiple of 4)
+ */
+void EEPROMClass::setLayout(uint16_t size) {
+	_size = size;
+	_slotSize = slotSize(size, _mode);
+	_bitmapSize = sealed() ? 0 : computeBitmapSize(_slotSize);
+
+	// keep the end of the sector for the stats unless that costs more than 1/8 of the copies
+	// (or in delta mode 1/8 of the room for records after the checkpoint)
+	_end = SPI_FLASH_SEC_SIZE;
+	if (_mode & EEPROM_MODE_DELTA) {
+		uint16_t room = SPI_FLASH_SEC_SIZE - 4 - size;
+		if (room > STATS_SIZE && (room - STATS_SIZE) * 8 >= room * 7) {
+			_end -= STATS_SIZE;
+		}
+	} else {
+		uint16_t first = 4 + _bitmapSize;
+		uint16_t copies = (SPI_FLASH_SEC_SIZE - first) / _slotSize;
+		uint16_t copiesLeft = (SPI_FLASH_SEC_SIZE - STATS_SIZE - first) / _slotSize;
+		if (copiesLeft > 0 && copiesLeft * 8 >= copies * 7) {
+			_end -= STATS_SIZE;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Find the latest copy in the flash and load it into the buffer (or view it).
+ *
+ * _dirty is cleared if the latest copy is good and _offset set to zero if there is none.
+ *
+ * @param canMigrate Load data of another size if there is no copy of this size
+ */
+void EEPROMClass::readLatest(bool canMigrate) {
+	// read the size together with the first word of the bitmap
+	uint32_t header[2];
+
+	if (readHint(header)) {
+		// RTC memory said where the latest copy is and the flash agrees
+		_dirty = false;
+
+	} else if (!findSector(header)) {
+		// flash structure is all wrong - will need to re-do
+		_offset = 0;    // offset of zero => flash data is garbage
+		if (canMigrate) {
+			migrate();
+		}
+
+	} else if (_mode & EEPROM_MODE_DELTA) {
+		readDelta();
+	} else if (sealed()) {
+		readSealed();
+	} else {
+		// Size is correct so get bitmap/data from flash
+		// First locate the used part of the bitmap in flash
+		readBitmap(header[1]);
+
+		// flash should contain a good version of the data - find it using the bitmap
+		_offset = offsetFromBitmap();
+
+		if (_offset == 0 || _offset + _slotSize > SPI_FLASH_SEC_SIZE) {
+			// something is screwed up
+			// flag that _data[] is bad / uninitialised
+			_offset = 0;
+		} else if (readCopy(_offset)) {
+			// all good
+			_dirty = false;
+		} else {
+			// latest copy is damaged - use the newest good one before it
+			// and leave _offset alone so the next commit writes after the damaged copy
+			uint16_t first = 4 + _bitmapSize;
+			uint16_t offset = _offset;
+			bool found = false;
+			while (offset > first && !found) {
+				offset -= _slotSize;
+				found = readCopy(offset);
+			}
+			if (found) {
+				markDirty(0, _size);
+				_offsetDamaged = true;
+			} else {
+				if (_data) {
+					memset(_data, 0, _size);
+				}
+				_view = 0;
+				_offset = 0;
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load the data in EEPROM_MODE_DELTA from the checkpoint and the log of changes.
+ */
+void EEPROMClass::readDelta() {
+	flashRead(4, _data, _size);
+
+	bool torn;
+	_offset = replayDelta(SPI_FLASH_SEC_SIZE, torn);
+	if (torn) {
+		// the log ends with an incomplete commit that has been partly applied - start again
+		// but stop at the end of the last complete commit
+		flashRead(4, _data, _size);
+		replayDelta(_offset, torn);
+	}
+
+	if (_shadow != _data) {
+		memcpy(_shadow, _data, _size);  // not when loadFlash() replays into the shadow
+	}
+	_dirty = false;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load the data in EEPROM_MODE_SEALED from the newest slot with a good seal.
+ *
+ * Slots are used in order so a binary search finds the first one with an erased seal;
+ * every slot before it has been written (or abandoned).
+ */
+void EEPROMClass::readSealed() {
+	uint16_t nSlots = (_end - 4) / _slotSize;
+	uint16_t lo = 0;
+	uint16_t hi = nSlots;
+	uint32_t seal;
+
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+		flashRead(4 + mid * _slotSize + _size, &seal, 4);
+		if (seal != 0xffffffff) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	// the next commit goes after the last used slot, even if that one is no good
+	_offset = 4 + (lo - 1) * _slotSize;
+	for (uint16_t slot = lo; slot-- > 0;) {
+		flashRead(4 + slot * _slotSize + _size, &seal, 4);
+		if (seal == (SEAL_TAG | slot)) {
+			if (_data) {
+				flashRead(4 + slot * _slotSize, _data, _size);
+			} else {
+				_view = mappedFlash(4 + slot * _slotSize);
+			}
+			if (slot + 1 == lo) {
+				_dirty = false;
+			} else {
+				markDirty(0, _size);
+				_offsetDamaged = true;
+			}
+			return;
+		}
+	}
+	_offset = 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Get the size of the newest data of a different size in the current mode left in the flash.
+ *
+ * @return The size, or 0 if there is none
+ */
+uint16_t EEPROMClass::findOldSize() {
+	uint16_t oldSize = 0;
+	uint8_t oldGeneration = 0;
+	for (uint8_t i = 0; i < _sectorCount; i++) {
+		uint32_t header;
+		flashRead(_firstSector + i, 0, &header, 4);
+		uint32_t size = header & 0xffff;
+		if ((header & 0x00ff0000) != _mode || size == _size || size < EEPROM_MIN_SIZE
+				|| size > SPI_FLASH_SEC_SIZE - 8 || (size & 3)) {
+			continue;
+		}
+		uint8_t gen = header >> 24;
+		if (oldSize == 0 || static_cast<int8_t>(gen - oldGeneration) > 0) {
+			oldSize = size;
+			oldGeneration = gen;
+		}
+	}
+	return oldSize;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load data of a different size left in the flash into the buffer.
+ *
+ * The latest copy of the old size is found as begin() would with the layout of that size,
+ * using the zeroed buffer for its bitmap (in EEPROM_MODE_DELTA for replaying its log), and
+ * the start of it read into the buffer.  The buffer is all marked as changed so the next
+ * commit writes it in the new size.
+ * The buffer only grows for that if the library allocated it - a buffer from the caller
+ * (e.g. StaticEEPROM) too small for the old data (only in EEPROM_MODE_DELTA, for data more
+ * than about twice the new size) means the old data is not migrated.
+ *
+ * @return True if old data was found
+ */
+bool EEPROMClass::migrate() {
+	uint16_t oldSize = findOldSize();
+	if (oldSize == 0) {
+		return false;
+	}
+
+	uint16_t size = _size;
+	uint8_t* data = _data;
+	uint8_t* bitmap = _bitmap;
+	uint32_t* dirtyMap = _dirtyMap;
+	uint8_t* shadow = _shadow;
+	bool delta = _mode & EEPROM_MODE_DELTA;
+
+	setLayout(oldSize);
+	uint16_t used = delta ? _size : _bitmapSize;
+	if (used > _bufferLength && _ownsBuffer) {
+		// a buffer the library allocated can grow for the old data - the layout moves with it
+		uint8_t* buffer = new uint8_t[used];
+		memset(buffer, 0, used);
+		data = buffer;
+		bitmap = buffer + (bitmap - _buffer);
+		dirtyMap = reinterpret_cast<uint32_t*>(buffer
+				+ (reinterpret_cast<uint8_t*>(dirtyMap) - _buffer));
+		if (shadow) {
+			shadow = buffer + (shadow - _buffer);
+		}
+		delete[] _buffer;
+		_buffer = buffer;
+		_bufferLength = used;
+		_data = buffer;
+	}
+	bool found = false;
+	uint16_t from = 0;
+	if (used <= _bufferLength) {
+		_dirtyMap = 0;
+		if (delta) {
+			_shadow = _data;    // the start of the old data is replayed in place
+		} else {
+			_bitmap = _data;
+			_data = 0;          // the copies are only checked
+		}
+		readLatest(false);
+		if (delta) {
+			found = _offset != 0;
+		} else if (_view) {
+			found = true;
+			from = _view - mappedFlash(0);
+		}
+	}
+
+	// back to the new size - carrying on from the old data's sector in a ring so the next
+	// commit is the newest
+	setLayout(size);
+	_data = data;
+	_bitmap = bitmap;
+	_dirtyMap = dirtyMap;
+	_shadow = shadow;
+	_view = 0;
+	_offset = 0;
+	_offsetDamaged = false;
+
+	uint16_t keep = (oldSize < _size) ? oldSize : _size;
+	if (!found) {
+		if (used <= _bufferLength) {
+			memset(_buffer, 0, used);
+		}
+	} else if (delta) {
+		if (used > keep) {
+			memset(_data + keep, 0, used - keep);
+		}
+	} else {
+		memset(_buffer, 0, used);
+		flashRead(from, _data, keep);
+	}
+	markDirty(0, _size);
+
+	if (found && _migration) {
+		_migration(_data, oldSize, _size);
+	}
+	return found;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Hold a commit in RTC memory instead of the flash unless it is time to write the flash.
+ *
+ * Only a commit that changed the data counts towards the flush.  The RTC copy is written
+ * either way so the data survives if the flash write is cut short.
+ *
+ * @return True if the commit is complete
+ */
+bool EEPROMClass::stageRtc() {
+	if (!rtcTier() || !_data) {
+		return false;
+	}
+	if (!_dirty) {
+		if (!_rtcPending) {
+			return false;
+		}
+		_status = EEPROM_DONE;  // already staged
+		return true;
+	}
+	_rtcPending++;
+	writeRtc();
+	if (_rtcPending < _rtcFlushEvery) {
+		clearDirty();   // _rtcPending now says the flash is behind
+		_counters.rtcCommits++;
+		_status = EEPROM_DONE;
+		return true;
+	}
+	return false;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load the buffer from the copy in RTC memory if that is good.
+ *
+ * The CRC is checked before anything is copied to the buffer.
+ *
+ * @return False if the RTC memory does not hold a good copy of the data of this size and mode
+ */
+bool EEPROMClass::readRtc() {
+	uint32_t header[4];
+	if (!system_rtc_mem_read(RTC_USER_BLOCK + _rtcBlock, header, sizeof(header))
+			|| header[0] != RTC_MAGIC || header[1] != (_size | _mode)) {
+		return false;
+	}
+
+	uint32_t crc = crc32(0, reinterpret_cast<const uint8_t*>(header), 12);
+	uint32_t words[8];
+	for (uint16_t pos = 0; pos < _size; pos += sizeof(words)) {
+		uint16_t len = (_size - pos < sizeof(words)) ? _size - pos : sizeof(words);
+		system_rtc_mem_read(RTC_USER_BLOCK + _rtcBlock + 4 + pos / 4, words, len);
+		crc = crc32(crc, reinterpret_cast<const uint8_t*>(words), len);
+	}
+	if (crc != header[3]) {
+		return false;
+	}
+
+	system_rtc_mem_read(RTC_USER_BLOCK + _rtcBlock + 4, _data, _size);
+	_rtcPending = header[2];
+	clearDirty();
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Save the buffer to RTC memory - the data first so a reset part way leaves a bad CRC.
+ */
+void EEPROMClass::writeRtc() {
+	uint32_t header[4] = { RTC_MAGIC, _size | _mode, _rtcPending, 0 };
+	header[3] = crc32(crc32(0, reinterpret_cast<const uint8_t*>(header), 12), _data, _size);
+	system_rtc_mem_write(RTC_USER_BLOCK + _rtcBlock + 4, _data, _size);
+	system_rtc_mem_write(RTC_USER_BLOCK + _rtcBlock, header, sizeof(header));
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Find the state of the flash after begin() loaded the data from RTC memory.
+ *
+ * The buffer and its changes are left alone - copies in the flash are only checked, as in
+ * read-only mode, except in EEPROM_MODE_DELTA where the log is replayed into the shadow.
+ */
+void EEPROMClass::loadFlash() {
+	uint8_t* data = _data;
+	bool dirty = _dirty;
+
+	_data = _shadow;
+	_dirty = true;
+	readLatest(false);
+	_data = data;
+	_view = 0;
+	_dirty = _dirty || dirty;
+	readStats();
+	_rtcOnly = false;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load the latest copy from where the RTC memory hint says it is, if the flash agrees.
+ *
+ * @param header Set to the size word and first bitmap word of the sector
+ * @return False if there is no good hint - the flash has to be searched as usual
+ */
+bool EEPROMClass::readHint(uint32_t* header) {
+	uint32_t hint[5];
+	if (!_rtcHint || (_mode & EEPROM_MODE_DELTA)
+			|| !system_rtc_mem_read(RTC_USER_BLOCK + _rtcHintBlock, hint, sizeof(hint))
+			|| hint[0] != RTC_HINT_MAGIC
+			|| hint[4] != crc32(0, reinterpret_cast<const uint8_t*>(hint), 16)) {
+		return false;
+	}
+
+	uint32_t sector = hint[1];
+	uint16_t offset = hint[3];
+	uint16_t first = 4 + _bitmapSize;
+	if (sector < _firstSector || sector >= _firstSector + _sectorCount
+			|| (hint[2] & 0x00ffffff) != (_size | _mode) || offset < first
+			|| (offset - first) % _slotSize != 0 || offset + _slotSize > _end) {
+		return false;
+	}
+
+	_sector = sector;
+	flashRead(0, header, 8);
+	if (header[0] != hint[2]) {
+		return false;
+	}
+
+	if (sealed()) {
+		// the copy must be sealed and the slot after it not
+		uint16_t slot = (offset - 4) / _slotSize;
+		uint32_t seal;
+		if (!flashRead(offset + _size, &seal, 4) || seal != (SEAL_TAG | slot)) {
+			return false;
+		}
+		if (offset + 2 * _slotSize <= _end
+				&& (!flashRead(offset + _slotSize + _size, &seal, 4) || seal != 0xffffffff)) {
+			return false;
+		}
+		if (_data) {
+			flashRead(offset, _data, _size);
+		} else {
+			_view = mappedFlash(offset);
+		}
+	} else {
+		// only the bitmap word that should hold the first untouched bit is read
+		uint16_t bitNo = 1 + (offset - first) / _slotSize;
+		readBitmap(header[1], (bitNo + 1) / 32);
+		if (offsetFromBitmap() != offset || !readCopy(offset)) {
+			return false;
+		}
+	}
+
+	_offset = offset;
+	_generation = header[0] >> 24;
+	_prevSector = sector;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Note where the latest copy is in RTC memory - see setRtcHint().
+ */
+void EEPROMClass::writeHint() {
+	if (!_rtcHint || (_mode & EEPROM_MODE_DELTA) || _offset == 0 || _offset >= _end) {
+		return;
+	}
+	uint32_t hint[5] = { RTC_HINT_MAGIC, _sector,
+			_size | _mode | (static_cast<uint32_t>(_generation) << 24), _offset, 0 };
+	hint[4] = crc32(0, reinterpret_cast<const uint8_t*>(hint), 16);
+	system_rtc_mem_write(RTC_USER_BLOCK + _rtcHintBlock, hint, sizeof(hint));
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Forget the RTC memory hint as the flash is about to change.
+ */
+void EEPROMClass::clearHint() {
+	if (_rtcHint) {
+		uint32_t none = 0;
+		system_rtc_mem_write(RTC_USER_BLOCK + _rtcHintBlock, &none, 4);
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Load the statistics saved at the last erase of the sector and add an estimate of what
+ * has been written since.
+ */
+void EEPROMClass::readStats() {
+	uint32_t saved[4] = { 0 };
+	if (_end < SPI_FLASH_SEC_SIZE) {
+		flashRead(SPI_FLASH_SEC_SIZE - STATS_SIZE, saved, STATS_SIZE);
+	}
+	if (saved[0] != STATS_MAGIC) {
+		memset(saved, 0, sizeof(saved));
+	}
+	_stats.erases = saved[1];
+	_stats.commits = saved[2];
+	_stats.bytesWritten = saved[3];
+
+	if (_offset == 0 || _offset >= SPI_FLASH_SEC_SIZE) {
+		_stats.slot = 0;
+	} else if (_mode & EEPROM_MODE_DELTA) {
+		// slot was counted from the log
+		_stats.bytesWritten += _offset;
+	} else {
+		_stats.slot = (_offset - 4 - _bitmapSize) / _slotSize + 1;
+		_stats.bytesWritten += _offset + _slotSize;
+	}
+	_stats.commits += _stats.slot;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Apply the log records to _data.
+ *
+ * @param limit The offset in the sector at which to stop
+ * @param torn Set true if records beyond the last complete commit were applied
+ * @return The offset just after the last complete commit
+ */
+uint16_t EEPROMClass::replayDelta(uint16_t limit, bool &torn) {
+	uint32_t window[16];        // the log is read from flash in small chunks
+	uint16_t windowPos = 0;
+	uint16_t windowLen = 0;
+	uint32_t* data = reinterpret_cast<uint32_t*>(_data);
+	uint16_t nWords = _size / 4;
+	uint16_t pos = 4 + _size;
+	uint16_t validEnd = pos;
+
+	_stats.slot = 1;    // the checkpoint
+	while (pos + 4 <= limit) {
+		uint32_t header = readLogWord(pos, window, windowPos, windowLen);
+		uint16_t start = header & 0x3ff;
+		uint16_t count = (header >> 10) & 0x3ff;
+
+		if ((header & DELTA_TAG_MASK) != DELTA_TAG || count == 0
+				|| start + count > nWords || pos + 4 + count * 4 > limit) {
+			break;  // end of the log (or garbage)
+		}
+
+		pos += 4;
+		for (uint16_t i = 0; i < count; i++, pos += 4) {
+			data[start + i] = readLogWord(pos, window, windowPos, windowLen);
+		}
+		if (header & DELTA_LAST) {
+			validEnd = pos;
+			_stats.slot++;
+		}
+	}
+
+	torn = (pos != validEnd);
+	return validEnd;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read a word of the log through a small window buffer.
+ *
+ * @param pos The offset of the word in the sector
+ * @param window Buffer holding flash from windowPos
+ * @param windowPos The offset in the sector of the start of the window
+ * @param windowLen The number of bytes held in the window
+ * @return The word at pos
+ */
+uint32_t EEPROMClass::readLogWord(uint16_t pos, uint32_t* window, uint16_t &windowPos,
+		uint16_t &windowLen) {
+	if (pos < windowPos || pos >= windowPos + windowLen) {
+		windowPos = pos;
+		windowLen = SPI_FLASH_SEC_SIZE - pos;
+		if (windowLen > 64) {
+			windowLen = 64;
+		}
+		flashRead(pos, window, windowLen);
+	}
+	return window[(pos - windowPos) / 4];
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Find the next run of words in _data that differ from the last committed data.
+ *
+ * Only words flagged as changed are compared.
+ *
+ * Runs separated by a single unchanged word are merged as that costs no more
+ * than the header of another record.
+ *
+ * @param from The word index to start looking from
+ * @param start Set to the word index of the start of the run
+ * @param count Set to the number of words in the run
+ * @return True if a changed run was found
+ */
+bool EEPROMClass::nextChangedRange(uint16_t from, uint16_t &start, uint16_t &count) {
+	const uint32_t* now = reinterpret_cast<const uint32_t*>(_data);
+	const uint32_t* was = reinterpret_cast<const uint32_t*>(_shadow);
+	uint16_t nWords = _size / 4;
+
+	while (from < nWords && (!isWordDirty(from) || now[from] == was[from])) {
+		from++;
+	}
+	if (from >= nWords) {
+		return false;
+	}
+
+	uint16_t end = from + 1;
+	for (uint16_t w = end; w < nWords; w++) {
+		if (isWordDirty(w) && now[w] != was[w]) {
+			end = w + 1;
+		} else if (w > end) {
+			break;  // two unchanged words - worth starting a new record
+		}
+	}
+
+	start = from;
+	count = end - from;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Check that an area of a flash sector is still in the erased state.
+ *
+ * This reads a flash page at a time and stops at the first word that isn't erased,
+ * so it is quick for a sector that is in use.
+ *
+ * @param sector The flash sector
+ * @param pos The offset in the sector of the start of the area
+ * @param length The number of bytes to check (a multiple of 4)
+ * @return True if every byte is 0xFF
+ */
+bool EEPROMClass::isErased(uint32_t sector, uint32_t pos, uint32_t length) {
+	uint32_t buf[64];
+	while (length > 0) {
+		uint32_t chunk = (length > sizeof(buf)) ? sizeof(buf) : length;
+		if (!flashRead(sector, pos, buf, chunk)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < chunk / 4; i++) {
+			if (buf[i] != 0xffffffff) {
+				return false;
+			}
+		}
+		pos += chunk;
+		length -= chunk;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read from the flash sector with interrupts held off.
+ *
+ * @param pos The offset in the sector (a multiple of 4)
+ * @param buf Where to put the data (4 byte aligned)
+ * @param length The number of bytes (a multiple of 4)
+ * @return True if the read was successful
+ */
+bool EEPROMClass::flashRead(uint32_t pos, void* buf, uint32_t length) {
+	return flashRead(_sector, pos, buf, length);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read from any flash sector with interrupts held off.
+ *
+ * @param sector The flash sector
+ * @param pos The offset in the sector (a multiple of 4)
+ * @param buf Where to put the data (4 byte aligned)
+ * @param length The number of bytes (a multiple of 4)
+ * @return True if the read was successful
+ */
+bool EEPROMClass::flashRead(uint32_t sector, uint32_t pos, void* buf, uint32_t length) {
+	noInterrupts();
+	uint32_t start = micros();
+	SpiFlashOpResult flashOk = spi_flash_read(sector * SPI_FLASH_SEC_SIZE + pos,
+			reinterpret_cast<uint32_t*>(buf), length);
+	uint32_t us = micros() - start;
+	interrupts();
+	noteInterruptsOff(us);
+#ifdef ESP_EEPROM_PROFILE
+	profileOp(EEPROM_OP_READ, length, us);
+#endif
+	return (flashOk == SPI_FLASH_RESULT_OK);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write to the flash sector with interrupts held off.
+ *
+ * @param pos The offset in the sector (a multiple of 4)
+ * @param buf The data to write (4 byte aligned)
+ * @param length The number of bytes (a multiple of 4)
+ * @return True if the write was successful
+ */
+bool EEPROMClass::flashWrite(uint32_t pos, const void* buf, uint32_t length) {
+	noInterrupts();
+	uint32_t start = micros();
+	SpiFlashOpResult flashOk = spi_flash_write(_sector * SPI_FLASH_SEC_SIZE + pos,
+			reinterpret_cast<uint32_t*>(const_cast<void*>(buf)), length);
+	uint32_t us = micros() - start;
+	interrupts();
+	noteInterruptsOff(us);
+#ifdef ESP_EEPROM_PROFILE
+	profileOp(EEPROM_OP_WRITE, length, us);
+#endif
+	_stats.bytesWritten += length;
+	return (flashOk == SPI_FLASH_RESULT_OK);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Keep track of the longest time interrupts have been held off for a flash operation.
+ *
+ * @param us The time in microseconds
+ */
+void EEPROMClass::noteInterruptsOff(uint32_t us) {
+	if (us > _irqOffMax) {
+		_irqOffMax = us;
+	}
+}
+
+#ifdef ESP_EEPROM_PROFILE
+//------------------------------------------------------------------------------
+/**
+ * Get the timings of the flash operations done since start-up (or resetProfile()).
+ *
+ * Only available when the library is built with ESP_EEPROM_PROFILE defined.
+ *
+ * @return The timings, indexed by EEPROM_OP_READ, EEPROM_OP_WRITE and EEPROM_OP_ERASE
+ */
+const EEPROMProfile& EEPROMClass::profile() {
+	return _profile;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Clear the timings of flash operations.
+ */
+void EEPROMClass::resetProfile() {
+	memset(&_profile, 0, sizeof(_profile));
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Print the timings of flash operations, e.g. EEPROM.printProfile(Serial).
+ *
+ * For each type of operation this prints the totals and then a line for each histogram
+ * bucket that has been used, giving the upper limit of the bucket.
+ *
+ * @param out Where to print
+ */
+void EEPROMClass::printProfile(Print &out) {
+	static const char* const names[EEPROM_OP_COUNT] = { "read", "write", "erase" };
+
+	for (uint8_t op = 0; op < EEPROM_OP_COUNT; op++) {
+		out.print(names[op]);
+		out.print(": ");
+		out.print(_profile.count[op]);
+		out.print(" ops, ");
+		out.print(_profile.bytes[op]);
+		out.print(" bytes, ");
+		out.print(_profile.totalUs[op]);
+		out.print(" us total, ");
+		out.print(_profile.maxUs[op]);
+		out.println(" us max");
+
+		for (uint8_t b = 0; b < EEPROM_PROFILE_BUCKETS; b++) {
+			if (_profile.histogram[op][b]) {
+				bool last = (b == EEPROM_PROFILE_BUCKETS - 1);
+				out.print(last ? "  >= " : "  < ");
+				out.print(last ? 1UL << (b - 1) : 1UL << b);
+				out.print(" us: ");
+				out.println(_profile.histogram[op][b]);
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Add a flash operation to the profile.
+ *
+ * @param op EEPROM_OP_READ, EEPROM_OP_WRITE or EEPROM_OP_ERASE
+ * @param bytes The number of bytes read, written or erased
+ * @param us How long it took in microseconds
+ */
+void EEPROMClass::profileOp(uint8_t op, uint32_t bytes, uint32_t us) {
+	// bucket b holds times below 2^b us
+	uint8_t bucket = us ? 32 - __builtin_clz(us) : 0;
+	if (bucket >= EEPROM_PROFILE_BUCKETS) {
+		bucket = EEPROM_PROFILE_BUCKETS - 1;
+	}
+	_profile.count[op]++;
+	_profile.bytes[op] += bytes;
+	_profile.totalUs[op] += us;
+	if (us > _profile.maxUs[op]) {
+		_profile.maxUs[op] = us;
+	}
+	_profile.histogram[op][bucket]++;
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+ * Erase a flash sector unless it is already blank.
+ *
+ * Checking costs a read of the sector (much less than an erase) and a sector that is
+ * in use is spotted straight away from its first word.
+ *
+ * @param sector The sector to erase
+ * @return True if the sector is now erased
+ */
+bool EEPROMClass::eraseIfNeeded(uint32_t sector) {
+	if (isErased(sector, 0, SPI_FLASH_SEC_SIZE)) {
+		_counters.erasesSkipped++;
+		return true;
+	}
+	_counters.erases++;
+	_stats.erases++;
+	return flashErase(sector);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Erase a flash sector with interrupts held off.
+ *
+ * @param sector The sector to erase
+ * @return True if the erase was successful
+ */
+bool EEPROMClass::flashErase(uint32_t sector) {
+	noInterrupts();
+	uint32_t start = micros();
+	SpiFlashOpResult flashOk = spi_flash_erase_sector(sector);
+	uint32_t us = micros() - start;
+	interrupts();
+	noteInterruptsOff(us);
+#ifdef ESP_EEPROM_PROFILE
+	profileOp(EEPROM_OP_ERASE, SPI_FLASH_SEC_SIZE, us);
+#endif
+	return (flashOk == SPI_FLASH_RESULT_OK);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Rebuild _bitmap from the flash without reading all of it.
+ *
+ * Copies are flagged in order so the used bits always form a prefix of the bitmap.
+ * A binary search for the first bitmap word that still has an untouched bit only needs
+ * to read about log2(words) words from flash; the words before it must be fully used
+ * and those after it must still be in the 'after flash' state.
+ *
+ * @param firstWord The first word of the bitmap, already read from flash
+ * @param known The word holding the first untouched bit, if known - 0 to search for it
+ */
+void EEPROMClass::readBitmap(uint32_t firstWord, uint16_t known) {
+	uint32_t* words = reinterpret_cast<uint32_t*>(_bitmap);
+	uint16_t nWords = _bitmapSize / 4;
+	uint32_t erased = (firstWord & 1) ? 0xffffffff : 0; // state of a bit after flash erase
+
+	words[0] = firstWord;
+
+	// bit 0 of the first word is the 'after flash' marker so is not a copy
+	uint16_t lo = 1;
+	uint16_t hi = nWords;
+	if ((~(firstWord ^ erased) & ~1) != 0) {
+		hi = 0;
+	} else if (known > 0 && known < nWords) {
+		flashRead(4 + known * 4, &words[known], 4);
+		lo = hi = known;
+	}
+
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+		flashRead(4 + mid * 4, &words[mid], 4);
+
+		if (~(words[mid] ^ erased) != 0) {
+			hi = mid;   // has an untouched bit - first such word is here or earlier
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	// words[hi] (if any) was read from flash - fill in the others
+	for (uint16_t w = 1; w < nWords; w++) {
+		if (w < hi) {
+			words[w] = ~erased;
+		} else if (w > hi) {
+			words[w] = erased;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Compute the offset of the current version of data using the bitmap
+ *
+ * @return The offset of the current version of data
+ */
+uint16_t EEPROMClass::offsetFromBitmap() {
+
+	if (!_bitmap || _bitmapSize <= 0)
+		return 0;
+
+	// The bitmap is scanned a 32-bit word at a time (bit n of the bitmap is bit n%32 of word n/32
+	// as flash is little-endian). XOR with the 'after flash' state turns every used bit into a 1
+	// so that both polarities are handled the same way.
+	const uint32_t* words = reinterpret_cast<const uint32_t*>(_bitmap);
+	uint32_t erased = (_bitmap[0] & 1) ? 0xffffffff : 0; // state of a bit after flash erase
+	uint16_t nWords = _bitmapSize / 4;
+
+	// Check - the very first entry in the bitmap should indicate a valid _data
+	if (((words[0] ^ erased) & 2) == 0) {
+		// something's wrong - Bitmap doesn't have bit recording first data version
+		return 0;
+	}
+
+	for (uint16_t w = 0; w < nWords; w++) {
+		// looking for bit state that matches the 'after flash' state (i.e. first untouched bit)
+		// bit 0 of the first word is the 'after flash' marker itself so never counts as untouched
+		uint32_t untouched = ~(words[w] ^ erased);
+		if (w == 0) {
+			untouched &= ~1;
+		}
+		if (untouched) {
+			int bitNo = w * 32 + __builtin_ctz(untouched);
+			return 4 + _bitmapSize + (bitNo - 2) * _slotSize; // offset pointed at last written
+		}
+	}
+
+	// dropped off the bottom - return the offset - but it will be useless
+	return 4 + _bitmapSize + (_bitmapSize * 8 - 2) * _slotSize;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read a copy of the data from the flash into the buffer, checking its CRC if it has one.
+ *
+ * @param offset The offset in the sector of the copy
+ * @return False if the CRC does not match.
+ */
+bool EEPROMClass::readCopy(uint16_t offset) {
+	if (!_data) {
+		_view = mappedFlash(offset);
+	} else if (!flashRead(offset, _data, _size)) {
+		return false;
+	}
+	if (!hasCrc()) {
+		return true;
+	}
+
+	uint32_t crc;
+	if (!flashRead(offset + _size, &crc, 4)) {
+		return false;
+	}
+	if (_data) {
+		return crc == crc32(0, _data, _size);
+	}
+
+	// read in small pieces - loadFlash() has no buffer and the sector may not be mapped
+	uint32_t check = 0;
+	uint32_t words[8];
+	for (uint16_t pos = 0; pos < _size; pos += sizeof(words)) {
+		uint16_t len = (_size - pos < sizeof(words)) ? _size - pos : sizeof(words);
+		if (!flashRead(offset + pos, words, len)) {
+			return false;
+		}
+		check = crc32(check, reinterpret_cast<const uint8_t*>(words), len);
+	}
+	return crc == check;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Flag within the bitmap the appropriate bit for the _data version at an offset
+ *
+ * @param offset The offset in the sector of the version
+ * @return The byte index within _bitmap that has been changed
+ */
+int EEPROMClass::flagUsedOffset(uint16_t offset) {
+	int bitNo = 1 + (offset - 4 - _bitmapSize) / _slotSize;
+	int byteNo = bitNo >> 3;
+
+	uint8_t bitMask = 1 << (bitNo & 0x7);
+	if (_bitmap[0] & 1) {
+		// need to clear the bitmap bit
+		_bitmap[byteNo] &= ~bitMask;
+	} else {
+		// need to set the bitmap bit
+		_bitmap[byteNo] |= bitMask;
+	}
+
+	return byteNo;
 }
 
 //------------------------------------------------------------------------------
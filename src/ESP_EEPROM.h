@@ -26,12 +26,96 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 /** If you were to use a tiny amount of EEPROM then the allocation bitmap would take a lot of
  * room and a long time to check so the minimum size is limited
  */
 const size_t EEPROM_MIN_SIZE = 16;
 
+/** Size of a flash sector - the same as SPI_FLASH_SEC_SIZE */
+const size_t EEPROM_SECTOR_SIZE = 4096;
+
+/** Modes for setMode() - the mode is kept in the flash alongside the size */
+const uint32_t EEPROM_MODE_COPY = 0;            ///< each commit() writes a full copy
+const uint32_t EEPROM_MODE_DELTA = 0x00010000;  ///< each commit() appends only changed words
+const uint32_t EEPROM_MODE_CRC = 0x00020000;    ///< add to EEPROM_MODE_COPY to check each copy with a CRC
+const uint32_t EEPROM_MODE_SEALED = 0x00040000; ///< each copy ends with its own marker - one write per commit()
+
+/** Default quiet period (ms) with no changes before a deferred commit - see EEPROMClass::commitDeferred() */
+const uint32_t EEPROM_DEFER_QUIET = 250;
+
+/** Size of the esp8266 RTC memory that is free for the user - see EEPROMClass::setRtcTier() */
+const size_t EEPROM_RTC_SIZE = 512;
+
+/** Default for the most that is written to flash in one go - the size of a flash page */
+const size_t EEPROM_WRITE_CHUNK = 256;
+
+/** Progress of a commit - see EEPROMClass::commitAsync() */
+enum EEPROMStatus {
+	EEPROM_IDLE,     ///< no commit has been started
+	EEPROM_ERASING,  ///< commit in progress - the sector will be erased next
+	EEPROM_WRITING,  ///< commit in progress - data is being written
+	EEPROM_DONE,     ///< the last commit succeeded
+	EEPROM_FAILED    ///< the last commit failed
+};
+
+/** Counts of what the library has done to the flash since start-up - see EEPROMClass::counters() */
+struct EEPROMCounters {
+	uint32_t erases;         ///< sector erases done
+	uint32_t erasesSkipped;  ///< sector erases not needed as the sector was already blank
+	uint32_t slotAdvancesSaved; ///< commits written over the latest copy instead of as a new one
+	uint32_t rtcCommits;     ///< commits held in RTC memory instead of written to the flash
+	uint32_t commitsCoalesced; ///< deferred commits merged into another commit
+	uint32_t commitsSkipped; ///< commits not written as the flash already held the same data
+};
+
+/** Erase cycles each flash sector is rated for - used to estimate the remaining endurance */
+const uint32_t EEPROM_FLASH_ENDURANCE = 100000;
+
+/** Lifetime statistics of the EEPROM flash - see EEPROMClass::getStats() */
+struct EEPROMStats {
+	uint32_t erases;           ///< erases of the EEPROM sector(s)
+	uint32_t commits;          ///< commits that wrote to the flash
+	uint32_t bytesWritten;     ///< bytes written to the flash
+	uint16_t slot;             ///< commits held in the current sector since its last erase
+	uint32_t remainingErases;  ///< erases left before the rated endurance is used up
+};
+
+#ifdef ESP_EEPROM_PROFILE
+class Print;
+
+/** Types of flash operation - indexes of EEPROMProfile */
+enum EEPROMFlashOp {
+	EEPROM_OP_READ,
+	EEPROM_OP_WRITE,
+	EEPROM_OP_ERASE,
+	EEPROM_OP_COUNT
+};
+
+/** Number of log2 histogram buckets - the last holds everything from 2^(n-2) us */
+const uint8_t EEPROM_PROFILE_BUCKETS = 18;
+
+/** Timings of flash operations - see EEPROMClass::profile().  Only with ESP_EEPROM_PROFILE. */
+struct EEPROMProfile {
+	uint32_t count[EEPROM_OP_COUNT];    ///< number of operations
+	uint32_t bytes[EEPROM_OP_COUNT];    ///< bytes read, written or erased
+	uint32_t totalUs[EEPROM_OP_COUNT];  ///< total time taken
+	uint32_t maxUs[EEPROM_OP_COUNT];    ///< longest single operation
+	uint32_t histogram[EEPROM_OP_COUNT][EEPROM_PROFILE_BUCKETS];  ///< bucket b counts times < 2^b us
+};
+#endif
+
+/**
+ * Called by begin() when the flash holds data of a different size (see
+ * EEPROMClass::setMigration())
+ *
+ * @param data The buffer - the old data (cut short or followed by zeros) may be changed freely
+ * @param oldSize The size of the data in the flash
+ * @param newSize The size of the buffer
+ */
+typedef void (*EEPROMMigration)(uint8_t* data, size_t oldSize, size_t newSize);
+
 class EEPROMClass {
 public:
 
@@ -39,13 +123,44 @@ public:
 	EEPROMClass(uint32_t sector);
 	
 	void begin(size_t size);
+	void begin(size_t size, uint8_t* buffer, size_t length);
+	void reload();
+	bool flush();
 	uint8_t read(int const address);
 	void write(int const address, uint8_t const val);
+	size_t readBytes(int const address, void* buf, size_t length);
+	bool writeBytes(int const address, const void* buf, size_t length);
+	bool fill(int const address, uint8_t const val, size_t length);
 	bool commit();
+	bool commitAsync();
+	void commitDeferred(uint32_t maxDelayMs, uint32_t quietMs = EEPROM_DEFER_QUIET);
+	EEPROMStatus poll();
+	EEPROMStatus status();
+	void setWriteChunk(size_t bytes, bool yieldBetween = false);
+	uint32_t maxInterruptsOff();
+	const EEPROMCounters& counters();
+	void getStats(EEPROMStats &stats);
+#ifdef ESP_EEPROM_PROFILE
+	const EEPROMProfile& profile();
+	void resetProfile();
+	void printProfile(Print &out);
+#endif
 	bool commitReset();
 	bool wipe();
 	int percentUsed();
+	bool willEraseOnNextCommit();
+	int commitsUntilErase();
+	bool maintain(int thresholdPercent);
 	void end();
+	void setMode(uint32_t mode);
+	void setInPlace(bool enable);
+	void setReadOnly(bool enable);
+	void setMigration(EEPROMMigration migration);
+	void setRtcTier(uint16_t flushEvery, uint8_t block = 0);
+	void setRtcHint(bool enable, uint8_t block = 123);
+	const uint8_t* view();
+	void setSectors(uint32_t firstSector, uint8_t count);
+	size_t dirtyRange(size_t from, size_t &length);
 
 	/**
 	 * Obtain EEPROM data for a variable stored at the address.
@@ -55,7 +170,8 @@ public:
 	 * way to maintain and access the EEPROM data.
 	 *
 	 * The actual flash data is read in the begin() call and so this function only reads from
-	 * the buffered data which makes it relatively fast.
+	 * the buffered data which makes it relatively fast.  In read-only mode (see setReadOnly())
+	 * it reads the flash through the memory mapped window instead.
 	 *
 	 * @param address The offset of the variable with the EEPROM data
 	 * @param v The variable to hold the retrieved data
@@ -63,8 +179,12 @@ public:
 	 */
 	template<typename T>
 	T &get(int const address, T &v) {
-		if (_data && (address >= 0) && (address + sizeof(T) <= _size)) {
-			memcpy((uint8_t*) &v, _data + address, sizeof(T));
+		if ((address >= 0) && (address + sizeof(T) <= _size)) {
+			if (_data) {
+				memcpy((uint8_t*) &v, _data + address, sizeof(T));
+			} else if (_view) {
+				readView(address, &v, sizeof(T));
+			}
 		}
 		return v;
 	}
@@ -73,12 +193,15 @@ public:
 	 * Write data to the EEPROM buffer.
 	 *
 	 * The function checks if the data is different from that already in the buffer.
+	 * If it is, the 4 byte words of the buffer it covers are flagged as changed.
 	 *
 	 * The data is written to the internal buffer but is only written to the
 	 * flash memory in the commit() function.  The commit() function only writes to flash
 	 * if there have been changes to the buffered data (or if the buffered data has never been written
 	 * to the flash previously).
 	 *
+	 * In read-only mode (see setReadOnly()) the first put() switches to using a buffer.
+	 *
 	 * @see commit()
 	 *
 	 * @param address Relative address to which to write the data within the EEPROM buffer.
@@ -87,14 +210,15 @@ public:
 	 */
 	template<typename T>
 	const T &put(int const address, const T &v) {
+		if (viewing()) {
+			unview();
+		}
 		if (_data && (address >= 0) && (address + sizeof(T) <= _size)) {
 
-			// only flag as dirty and copied if different - if already dirty, just get on with copy
-			if (_dirty
-					|| memcmp(_data + address, (const uint8_t*) &v, sizeof(T))
-							!= 0) {
-				_dirty = true;
+			// only flag as dirty and copied if different
+			if (memcmp(_data + address, (const uint8_t*) &v, sizeof(T)) != 0) {
 				memcpy(_data + address, (const uint8_t*) &v, sizeof(T));
+				markDirty(address, sizeof(T));
 			}
 		}
 		return v;
@@ -109,18 +233,235 @@ public:
 		return _size;
 	}
 
+	/**
+	 * Get the size of the buffer begin() needs for the data, bitmap, record of changes and
+	 * (in EEPROM_MODE_DELTA) the committed copy - for begin(size, buffer, length).
+	 *
+	 * @param size The size of the EEPROM data
+	 * @param mode The mode - see setMode()
+	 * @return The size in bytes
+	 */
+	static constexpr size_t bufferSize(size_t size, uint32_t mode) {
+		return slotSize(size, mode)
+				+ (((mode & (EEPROM_MODE_DELTA | EEPROM_MODE_SEALED)) == EEPROM_MODE_SEALED) ?
+						0 : computeBitmapSize(slotSize(size, mode)))
+				+ ((alignedSize(size) / 4 + 31) / 32) * 4
+				+ ((mode & EEPROM_MODE_DELTA) ? alignedSize(size) : 0);
+	}
+
+protected:
+	void useBuffer(uint8_t* buffer, size_t length);
+
+	/**
+	 * Get the size of the data rounded up as it is held in the flash.
+	 */
+	static constexpr size_t alignedSize(size_t size) {
+		return (size < EEPROM_MIN_SIZE) ? EEPROM_MIN_SIZE : (size + 3) & ~3;
+	}
+
+	/**
+	 * Get the bytes of the sector taken by each copy of the data.
+	 */
+	static constexpr size_t slotSize(size_t size, uint32_t mode) {
+		return alignedSize(size) + ((!(mode & EEPROM_MODE_DELTA)
+				&& (mode & (EEPROM_MODE_CRC | EEPROM_MODE_SEALED))) ? 4 : 0);
+	}
+
+	/**
+	 * Compute size of bitmap needed for the number of copies that can be held
+	 *
+	 * With 1 bit in bitmap for each copy (and one more) and 8 bits per byte, rounded up to
+	 * a whole number of 4 byte words.
+	 *
+	 * @param size The size of each copy
+	 * @return Number of bytes required for the bitmap
+	 */
+	static constexpr uint16_t computeBitmapSize(size_t size) {
+		return (((((EEPROM_SECTOR_SIZE - 4L) * 8L - 1L) / (size * 8L + 1L) + 1L) + 31L) / 8L)
+				& ~3 & 0x7fff;
+	}
+
 private:
-	uint32_t _sector;
+	uint32_t _sector;       // sector holding the latest data
+	uint32_t _firstSector;  // ring of sectors used
+	uint8_t _sectorCount;
+	uint32_t _prevSector;   // sector before the current commit moved on
+	uint8_t _generation;    // of the current sector
+	bool _nextErased;       // next sector of the ring is known to be erased
+	uint8_t* _buffer;       // holds _data, _bitmap, _dirtyMap and _shadow
+	size_t _bufferLength;
+	bool _ownsBuffer;       // _buffer is allocated by begin()
+	bool _loaded;           // begin() has loaded _size bytes with the current settings
 	uint8_t* _data;
 	uint32_t _size;
 	uint16_t _bitmapSize;
+	uint16_t _slotSize;     // bytes of the sector taken by each copy
+	uint16_t _end;          // end of the part of the sector for data - the stats follow
 	uint8_t* _bitmap;
 	uint16_t _offset;
+	bool _offsetDamaged;    // the copy at _offset is damaged - the data came from an older one
 	bool _dirty;
+	uint32_t _mode;
+	bool _inPlace;          // rewrite the latest copy when the changes only program more bits
+	bool _readOnly;         // begin() reads the data through the mapped flash
+	const uint8_t* _view;   // the latest copy in the mapped flash when there is no _data
+	EEPROMMigration _migration;
+	uint16_t _rtcFlushEvery; // commits held in RTC memory before one goes to the flash
+	uint8_t _rtcBlock;      // of the user RTC memory to start at
+	uint16_t _rtcPending;   // commits in RTC memory that are not in the flash
+	bool _rtcOnly;          // data came from RTC memory - the flash has not been read
+	bool _rtcHint;          // keep where the latest copy is in RTC memory
+	uint8_t _rtcHintBlock;
+	uint8_t* _shadow;
+	uint32_t* _dirtyMap;    // 1 bit for each 4 byte word of _data changed since the last commit
 
+	// state of a commit in progress
+	uint8_t _status;
+	uint8_t _step;
+	bool _commitErase;      // the commit started by erasing the sector
+	uint16_t _commitOffset; // where the copy or delta record is being written
+	uint16_t _writeDone;    // bytes of the copy or delta record written so far
+	uint32_t _crc;          // of the part of the copy written so far
+	uint32_t _hash;         // CRC32 of the data in the latest copy in flash
+	bool _hashValid;
+	uint16_t _rangeStart;   // words of the delta record
+	uint16_t _rangeCount;
+
+	// commit waiting for the changes to stop - see commitDeferred()
+	bool _deferPending;
+	uint32_t _deferStart;   // millis() when the first deferred commit was asked for
+	uint32_t _deferMax;
+	uint32_t _deferQuiet;
+	uint32_t _lastChange;   // millis() of the last change while a commit is deferred
+
+	uint16_t _chunk;        // bytes written to flash in one go
+	bool _yield;            // yield() between chunks in commit()
+	uint32_t _irqOffMax;    // longest interrupts were held off (us) during the last commit
+	EEPROMCounters _counters;
+	EEPROMStats _stats;
+#ifdef ESP_EEPROM_PROFILE
+	EEPROMProfile _profile;
+#endif
+
+	bool findSector(uint32_t* header);
+	uint32_t nextSector();
+	bool eraseNextSector();
+	bool committing() {
+		return _status == EEPROM_ERASING || _status == EEPROM_WRITING;
+	}
+	bool hasCrc() {
+		return (_mode & EEPROM_MODE_CRC) && !(_mode & (EEPROM_MODE_DELTA | EEPROM_MODE_SEALED));
+	}
+	bool sealed() {
+		return (_mode & (EEPROM_MODE_DELTA | EEPROM_MODE_SEALED)) == EEPROM_MODE_SEALED;
+	}
+	bool viewing() {
+		return _readOnly && _size && !_data;
+	}
+	bool rtcTier() {
+		return _rtcFlushEvery && 16 + _size + 4 * _rtcBlock <= EEPROM_RTC_SIZE;
+	}
+	bool startCommit(bool useRtc);
+	bool stageRtc();
+	bool readRtc();
+	void writeRtc();
+	void loadFlash();
+	bool readHint(uint32_t* header);
+	void writeHint();
+	void clearHint();
+	void unview();
+	void readView(int address, void* buf, size_t length);
+	const uint8_t* mappedFlash(uint16_t pos);
+	bool finishCommit();
+	void endCommit(uint16_t offset);
+	void failCommit();
+	bool startDelta();
+	bool startRecord(uint16_t start, uint16_t count);
+	void setLayout(uint16_t size);
+	void readLatest(bool canMigrate);
+	void readDelta();
+	void readSealed();
+	void readStats();
+	uint16_t findOldSize();
+	bool migrate();
+	void release();
+	uint16_t replayDelta(uint16_t limit, bool &torn);
+	uint32_t readLogWord(uint16_t pos, uint32_t* window, uint16_t &windowPos,
+			uint16_t &windowLen);
+	bool nextChangedRange(uint16_t from, uint16_t &start, uint16_t &count);
+	bool isErased(uint32_t sector, uint32_t pos, uint32_t length);
+	bool eraseIfNeeded(uint32_t sector);
+	bool flashRead(uint32_t pos, void* buf, uint32_t length);
+	bool flashRead(uint32_t sector, uint32_t pos, void* buf, uint32_t length);
+	bool flashWrite(uint32_t pos, const void* buf, uint32_t length);
+	bool flashErase(uint32_t sector);
+	void noteInterruptsOff(uint32_t us);
+#ifdef ESP_EEPROM_PROFILE
+	void profileOp(uint8_t op, uint32_t bytes, uint32_t us);
+#endif
+	void markDirty(int const address, size_t length);
+	bool inRange(int const address, size_t length) {
+		return address >= 0 && length <= _size && (size_t) address <= _size - length;
+	}
+	bool update(int const address, const uint8_t* src, uint8_t const val, size_t length);
+	void clearDirty();
+	bool dirtyMatchesFlash(bool &canPatch);
+	bool compareFlash(uint16_t pos, uint16_t length, bool &canPatch);
+	void startCopy();
+	bool isWordDirty(uint16_t w) {
+		return (_dirtyMap[w / 32] >> (w & 31)) & 1;
+	}
+	void readBitmap(uint32_t firstWord, uint16_t known = 0);
 	uint16_t offsetFromBitmap();
-	int flagUsedOffset();
-	uint16_t computeBitmapSize(size_t size);
+	bool readCopy(uint16_t offset);
+	int flagUsedOffset(uint16_t offset);
+};
+
+/**
+ * An EEPROMClass with its buffers inside the object, sized at compile time, so that begin()
+ * never uses the heap.
+ * In EEPROM_MODE_DELTA that means data left in the flash at more than about twice N is not
+ * migrated (see EEPROMClass::setMigration()).
+ *
+ * e.g.
+ * + StaticEEPROM<sizeof(Config)> settings;
+ * + settings.begin();
+ * + settings.get(0, config);
+ *
+ * @tparam N The size of the EEPROM data
+ * @tparam MODE The mode (see EEPROMClass::setMode()) the buffers are sized for
+ */
+template<size_t N, uint32_t MODE = EEPROM_MODE_COPY>
+class StaticEEPROM: public EEPROMClass {
+public:
+	StaticEEPROM() {
+		setMode(MODE);
+		useBuffer(reinterpret_cast<uint8_t*>(_storage), sizeof(_storage));
+	}
+
+	StaticEEPROM(uint32_t sector) :
+			EEPROMClass(sector) {
+		setMode(MODE);
+		useBuffer(reinterpret_cast<uint8_t*>(_storage), sizeof(_storage));
+	}
+
+	using EEPROMClass::begin;
+
+	/**
+	 * Initialise the EEPROM system for N bytes of data - see EEPROMClass::begin().
+	 */
+	void begin() {
+		EEPROMClass::begin(N);
+	}
+
+private:
+	static_assert(N > 0, "StaticEEPROM needs some data");
+	static_assert(N <= EEPROM_SECTOR_SIZE - 8
+			&& 4 + slotSize(N, MODE) + (((MODE & (EEPROM_MODE_DELTA | EEPROM_MODE_SEALED))
+					== EEPROM_MODE_SEALED) ? 0 : computeBitmapSize(slotSize(N, MODE)))
+					<= EEPROM_SECTOR_SIZE, "StaticEEPROM data does not fit in a flash sector");
+
+	uint32_t _storage[(bufferSize(N, MODE) + 3) / 4];
 };
 
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_EEPROM)
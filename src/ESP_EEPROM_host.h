@@ -0,0 +1,332 @@
+/*
+ ESP_EEPROM_host.h - simulated esp8266 flash so ESP_EEPROM can be built and run on a PC
+
+ Copyright (c) 2018 James Watson. All rights reserved.
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/** @file
+ * Only used when ESP_EEPROM_HOST is defined - this stands in for the parts of the esp8266
+ * core and SDK that the library uses so the real EEPROMClass code can be compiled and
+ * profiled on a PC, e.g.
+ *
+ *     g++ -DESP_EEPROM_HOST -Isrc src/ESP_EEPROM.cpp my_test.cpp
+ *
+ * The tests and benchmarks in extras/host are built this way by its Makefile.
+ *
+ * The flash is simulated as NOR flash:
+ * - an erase sets a whole sector to 0xFF
+ * - a write can only clear bits (the new data is ANDed with what is there)
+ * - addresses, lengths and buffers must be 4 byte aligned
+ * - each operation advances a simulated clock (returned by micros() and millis()) by a
+ *   configurable latency
+ * - the number of erases of each sector is counted
+ * - the power can be cut part way through a write or erase (see FlashSim::powerBudget)
+ *
+ * The flash is held in RAM unless flashSimBegin() is given a file, in which case the
+ * file is memory mapped so the flash contents last from one run to the next.
+ *
+ * The EEPROM sector is sector 0 of the simulated flash.
+ *
+ * The esp8266 RTC memory is simulated too (FlashSim::rtc) - it is not reset by
+ * flashSimBegin() so it can stand in for RTC memory kept over deep sleep; clear it to
+ * simulate a power cut.
+ */
+
+#ifndef ESP_EEPROM_host_h
+#define ESP_EEPROM_host_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPI_FLASH_SEC_SIZE 4096
+#define EEPROM_start 0x40200000
+
+/** Default number of sectors of simulated flash */
+#ifndef ESP_EEPROM_HOST_SECTORS
+#define ESP_EEPROM_HOST_SECTORS 16
+#endif
+
+typedef bool boolean;
+
+typedef enum {
+	SPI_FLASH_RESULT_OK, SPI_FLASH_RESULT_ERR, SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+/** State of the simulated flash - see flashSim() */
+struct FlashSim {
+	uint8_t* mem;             ///< contents of the flash
+	uint32_t sectors;         ///< size of the flash in sectors
+	uint32_t* eraseCount;     ///< number of erases of each sector
+	bool mapped;              ///< mem is a memory mapped file
+
+	// latency added to the simulated clock for each operation
+	uint32_t readLatencyUs;   ///< per read
+	uint32_t readNsPerByte;   ///< per byte read
+	uint32_t writeLatencyUs;  ///< per write
+	uint32_t writeNsPerByte;  ///< per byte written
+	uint32_t eraseLatencyUs;  ///< per sector erase
+
+	uint64_t clockNs;         ///< the simulated clock
+
+	// totals of operations done
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t erases;
+	uint32_t bytesRead;
+	uint32_t bytesWritten;
+
+	// power loss - when the budget runs out the write or erase in progress stops part way
+	// through and every later operation fails until the power is back (powerBudget set to -1)
+	int32_t powerBudget;      ///< bytes that can be written or erased before the cut, -1 for no limit
+	bool powerOff;            ///< the budget has run out
+
+	uint32_t rtc[192];        ///< RTC memory in 4 byte blocks - blocks 64 onwards are for the user
+};
+
+/**
+ * The state of the simulated flash without creating it.
+ */
+inline FlashSim& flashSimState() {
+	static FlashSim sim = { 0, 0, 0, false, 10, 25, 20, 2700, 40000, 0, 0, 0, 0, 0, 0, -1, false, {} };
+	return sim;
+}
+
+/**
+ * Release the simulated flash - a mapped file is written back.
+ */
+inline void flashSimEnd() {
+	FlashSim& sim = flashSimState();
+	if (sim.mapped) {
+		munmap(sim.mem, sim.sectors * SPI_FLASH_SEC_SIZE);
+	} else {
+		free(sim.mem);
+	}
+	free(sim.eraseCount);
+	sim.mem = 0;
+	sim.eraseCount = 0;
+	sim.mapped = false;
+}
+
+/**
+ * (Re)create the simulated flash and clear the totals of operations done.
+ *
+ * @param sectors The size of the flash in sectors
+ * @param file If given, the flash is kept in this file (created erased if it doesn't exist)
+ * @return False if the file could not be mapped
+ */
+inline bool flashSimBegin(uint32_t sectors, const char* file = 0) {
+	FlashSim& sim = flashSimState();
+	size_t size = sectors * SPI_FLASH_SEC_SIZE;
+
+	flashSimEnd();
+	sim.sectors = sectors;
+	sim.reads = sim.writes = sim.erases = 0;
+	sim.bytesRead = sim.bytesWritten = 0;
+	sim.eraseCount = static_cast<uint32_t*>(calloc(sectors, sizeof(uint32_t)));
+
+	if (file) {
+		int fd = open(file, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		fstat(fd, &st);
+		bool fresh = (static_cast<size_t>(st.st_size) < size);
+		if (fresh && ftruncate(fd, size) != 0) {
+			close(fd);
+			return false;
+		}
+		void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			return false;
+		}
+		sim.mem = static_cast<uint8_t*>(mem);
+		sim.mapped = true;
+		if (fresh) {
+			memset(sim.mem, 0xff, size);
+		}
+	} else {
+		sim.mem = static_cast<uint8_t*>(malloc(size));
+		memset(sim.mem, 0xff, size);
+	}
+	return true;
+}
+
+/**
+ * Get the simulated flash - it is created with ESP_EEPROM_HOST_SECTORS erased sectors on
+ * first use unless flashSimBegin() has been called.
+ *
+ * The latencies default to typical figures for esp8266 flash (40MHz SPI).
+ *
+ * @return The state of the simulated flash which may be changed freely
+ */
+inline FlashSim& flashSim() {
+	FlashSim& sim = flashSimState();
+	if (!sim.mem) {
+		flashSimBegin(ESP_EEPROM_HOST_SECTORS);
+	}
+	return sim;
+}
+
+/**
+ * Use up the power budget.
+ *
+ * @param size The number of bytes about to be written or erased
+ * @return The number that can be done before the power is cut
+ */
+inline uint32_t flashSimPower(uint32_t size) {
+	FlashSim& sim = flashSim();
+	if (sim.powerBudget < 0) {
+		return size;
+	}
+	if (static_cast<uint32_t>(sim.powerBudget) < size) {
+		size = sim.powerBudget;
+		sim.powerOff = true;
+	}
+	sim.powerBudget -= size;
+	return size;
+}
+
+/**
+ * Check a flash operation is aligned and within the flash.
+ */
+inline bool flashSimCheck(uint32_t addr, const void* buf, uint32_t size) {
+	FlashSim& sim = flashSim();
+	if (sim.powerOff && sim.powerBudget < 0) {
+		sim.powerOff = false;   // power is back
+	}
+	return !sim.powerOff && (addr & 3) == 0 && (size & 3) == 0 && (reinterpret_cast<uintptr_t>(buf) & 3) == 0
+			&& addr + size <= sim.sectors * SPI_FLASH_SEC_SIZE;
+}
+
+inline SpiFlashOpResult spi_flash_read(uint32_t addr, uint32_t* dst, uint32_t size) {
+	FlashSim& sim = flashSim();
+	if (!flashSimCheck(addr, dst, size)) {
+		return SPI_FLASH_RESULT_ERR;
+	}
+	memcpy(dst, sim.mem + addr, size);
+	sim.reads++;
+	sim.bytesRead += size;
+	sim.clockNs += sim.readLatencyUs * 1000ULL + sim.readNsPerByte * size;
+	return SPI_FLASH_RESULT_OK;
+}
+
+inline SpiFlashOpResult spi_flash_write(uint32_t addr, uint32_t* src, uint32_t size) {
+	FlashSim& sim = flashSim();
+	if (!flashSimCheck(addr, src, size)) {
+		return SPI_FLASH_RESULT_ERR;
+	}
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(src);
+	uint32_t done = flashSimPower(size);
+	for (uint32_t i = 0; i < done; i++) {
+		sim.mem[addr + i] &= bytes[i];   // can only clear bits
+	}
+	sim.writes++;
+	sim.bytesWritten += done;
+	sim.clockNs += sim.writeLatencyUs * 1000ULL + sim.writeNsPerByte * done;
+	return (done == size) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+inline SpiFlashOpResult spi_flash_erase_sector(uint16_t sec) {
+	FlashSim& sim = flashSim();
+	if (!flashSimCheck(sec * SPI_FLASH_SEC_SIZE, &sim, SPI_FLASH_SEC_SIZE)) {
+		return SPI_FLASH_RESULT_ERR;
+	}
+	// an interrupted erase is modelled as erasing only the start of the sector
+	uint32_t done = flashSimPower(SPI_FLASH_SEC_SIZE);
+	memset(sim.mem + sec * SPI_FLASH_SEC_SIZE, 0xff, done);
+	sim.eraseCount[sec]++;
+	sim.erases++;
+	sim.clockNs += sim.eraseLatencyUs * 1000ULL;
+	return (done == SPI_FLASH_SEC_SIZE) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+inline bool system_rtc_mem_read(uint8_t block, void* dst, uint16_t size) {
+	FlashSim& sim = flashSim();
+	if (block < 64 || block * 4U + size > sizeof(sim.rtc)) {
+		return false;
+	}
+	memcpy(dst, reinterpret_cast<uint8_t*>(sim.rtc) + block * 4, size);
+	return true;
+}
+
+inline bool system_rtc_mem_write(uint8_t block, const void* src, uint16_t size) {
+	FlashSim& sim = flashSim();
+	if (block < 64 || block * 4U + size > sizeof(sim.rtc)) {
+		return false;
+	}
+	memcpy(reinterpret_cast<uint8_t*>(sim.rtc) + block * 4, src, size);
+	return true;
+}
+
+/**
+ * Just enough of the Arduino Print class for EEPROMClass::printProfile() - prints to stdout
+ * unless write() is overridden.
+ */
+class Print {
+public:
+	virtual ~Print() {
+	}
+	virtual size_t write(uint8_t c) {
+		return fputc(c, stdout) == EOF ? 0 : 1;
+	}
+	size_t print(const char* s) {
+		size_t n = 0;
+		while (*s) {
+			n += write(*s++);
+		}
+		return n;
+	}
+	size_t print(unsigned long v) {
+		char buf[12];
+		snprintf(buf, sizeof(buf), "%lu", v);
+		return print(buf);
+	}
+	size_t println(const char* s) {
+		return print(s) + write('\n');
+	}
+	size_t println(unsigned long v) {
+		return print(v) + write('\n');
+	}
+};
+
+inline void noInterrupts() {
+}
+
+inline void interrupts() {
+}
+
+inline void yield() {
+}
+
+inline uint32_t micros() {
+	return static_cast<uint32_t>(flashSim().clockNs / 1000);
+}
+
+inline uint32_t millis() {
+	return static_cast<uint32_t>(flashSim().clockNs / 1000000);
+}
+
+#endif